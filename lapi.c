@@ -383,6 +383,11 @@ LUA_API const char *lua_tolstring (lua_State *L, int idx, size_t *len) {
     o = index2addr(L, idx);  /* previous call may reallocate the stack */
     lua_unlock(L);
   }
+  else if (isstrview(tsvalue(o))) {  /* contents not followed by a '\0'? */
+    lua_lock(L);
+    luaS_detach(L, tsvalue(o));
+    lua_unlock(L);
+  }
   if (len != NULL)
     *len = vslen(o);
   return svalue(o);
@@ -488,6 +493,100 @@ LUA_API const char *lua_pushlstring (lua_State *L, const char *s, size_t len) {
 }
 
 
+/*
+** Pushes the 'len' bytes starting at offset 'pos' of the string at index
+** 'idx'. The result may share the contents of that string.
+*/
+LUA_API void lua_pushsubstring (lua_State *L, int idx, size_t pos,
+                                                       size_t len) {
+  StkId o;
+  TString *ts;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  api_check(L, ttisstring(o), "string expected");
+  ts = tsvalue(o);
+  api_check(L, pos <= tsslen(ts) && len <= tsslen(ts) - pos,
+               "invalid substring");
+  ts = luaS_newsub(L, ts, pos, len);
+  setsvalue2s(L, L->top, ts);
+  api_incr_top(L);
+  luaC_checkGC(L);
+  lua_unlock(L);
+}
+
+
+/*
+** Pushes a string whose contents 's' (which must be followed by a '\0')
+** are not copied; when the string is collected, they are released with
+** a call 'falloc(ud, s, len + 1, 0)' (unless 'falloc' is NULL). Until
+** then, the host must not change them. Lua takes 's' only when the
+** function returns: if it raises an error, 's' still belongs to the
+** caller. (So, the GC step comes before anything is created, and
+** nothing can raise an error after the string owns 's'.)
+*/
+LUA_API const char *lua_pushexternalstring (lua_State *L, const char *s,
+                           size_t len, lua_Alloc falloc, void *ud) {
+  TString *ts;
+  lua_lock(L);
+  api_check(L, s[len] == '\0', "string not ending with zero");
+  luaC_checkGC(L);
+  ts = luaS_newextlstr(L, s, len, falloc, ud);
+  setsvalue2s(L, L->top, ts);
+  api_incr_top(L);
+  lua_unlock(L);
+  return getstr(ts);
+}
+
+
+/*
+** Pushes an "open" string with room for 'len' bytes and returns its
+** contents, to be written by the caller. The string may be resized
+** and must be finished (with its final length) before any other use;
+** until then, the debug interface shows it as nil.
+*/
+LUA_API char *lua_prepstring (lua_State *L, size_t len) {
+  TString *ts;
+  lua_lock(L);
+  api_check(L, L->top < L->ci->top, "stack overflow");
+  ts = luaS_pushopen(L, len);  /* pushes the new string */
+  luaC_checkGC(L);
+  lua_unlock(L);
+  return getstr(ts);
+}
+
+
+static TString *toopenstr (lua_State *L, int idx) {
+  StkId o = index2addr(L, idx);
+  api_check(L, ttislngstring(o) && isstropen(tsvalue(o)),
+               "open string expected");
+  return tsvalue(o);
+}
+
+
+LUA_API char *lua_resizestring (lua_State *L, int idx, size_t len) {
+  TString *ts;
+  lua_lock(L);
+  ts = toopenstr(L, idx);
+  luaS_resizeopen(L, ts, len);
+  luaC_checkGC(L);
+  lua_unlock(L);
+  return getstr(ts);
+}
+
+
+LUA_API const char *lua_finishstring (lua_State *L, int idx, size_t len) {
+  TString *ts;
+  lua_lock(L);
+  ts = toopenstr(L, idx);
+  api_check(L, len <= ts->u.lnglen, "invalid string length");
+  ts = luaS_closeopen(L, ts, len);
+  setsvalue(L, index2addr(L, idx), ts);
+  luaC_checkGC(L);
+  lua_unlock(L);
+  return getstr(ts);
+}
+
+
 LUA_API const char *lua_pushstring (lua_State *L, const char *s) {
   lua_lock(L);
   if (s == NULL)
@@ -643,6 +742,43 @@ LUA_API int lua_geti (lua_State *L, int idx, lua_Integer n) {
 }
 
 
+/*
+** Table 't' has no metamethod 'e' (so, raw accesses are equivalent to
+** the corresponding regular ones, for keys that are already present
+** or absent according to the event)
+*/
+#define notm(L,t,e)  \
+	((t)->metatable == NULL || fasttm(L, (t)->metatable, e) == NULL)
+
+
+/*
+** Push t[i], ..., t[i+n-1] if they are all in the array part of table 't'
+** and it has no '__index' metamethod; returns 0, pushing nothing,
+** otherwise.
+*/
+LUA_API int lua_getarray (lua_State *L, int idx, lua_Integer i, int n) {
+  StkId o;
+  Table *t;
+  int res = 0;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  api_check(L, 0 <= n && n <= L->ci->top - L->top, "stack overflow");
+  t = hvalue(o);
+  if (i >= 1 && l_castS2U(i) - 1 + n <= t->sizearray &&
+      notm(L, t, TM_INDEX)) {
+    const TValue *a = &t->array[i - 1];
+    int k;
+    for (k = 0; k < n; k++)
+      setobj2s(L, L->top + k, a + k);
+    L->top += n;
+    res = 1;
+  }
+  lua_unlock(L);
+  return res;
+}
+
+
 LUA_API int lua_rawget (lua_State *L, int idx) {
   StkId t;
   lua_lock(L);
@@ -693,6 +829,26 @@ LUA_API void lua_createtable (lua_State *L, int narray, int nrec) {
 }
 
 
+/*
+** Push a new table with the same contents as the one at 'idx' (a raw,
+** shallow copy without metatable).
+*/
+LUA_API void lua_clonetable (lua_State *L, int idx) {
+  StkId o;
+  Table *t, *c;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  t = hvalue(o);
+  c = luaH_new(L);
+  sethvalue(L, L->top, c);
+  api_incr_top(L);
+  luaH_copy(L, c, t);
+  luaC_checkGC(L);
+  lua_unlock(L);
+}
+
+
 LUA_API int lua_getmetatable (lua_State *L, int objindex) {
   const TValue *obj;
   Table *mt;
@@ -1097,6 +1253,38 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       res = g->gcrunning;
       break;
     }
+    case LUA_GCSETMAXPAUSE: {
+      res = g->gcmaxpause;
+      if (data < 0) data = 0;  /* 0 turns off the timed pacer */
+      g->gcmaxpause = data;
+      break;
+    }
+    case LUA_GCSETGROWTH: {
+      res = g->gcgrowth;
+      if (data < 110) data = 110;  /* cycle needs some room to run */
+      g->gcgrowth = data;
+      break;
+    }
+    case LUA_GCSTEPHIST: {
+      if (0 <= data && data < GCNSTEPHIST) {
+        lu_mem n = g->gcsteptime[data];
+        res = (n < cast(lu_mem, MAX_INT)) ? cast_int(n) : MAX_INT;
+      }
+      else res = -1;  /* no such class */
+      break;
+    }
+    case LUA_GCATOMICSTATS: {  /* statistics about last atomic phase */
+      lu_mem n;
+      switch (data) {
+        case 0: n = cast(lu_mem, g->gcatomictime); break;  /* microseconds */
+        case 1: n = g->gcatomicwork >> 10; break;  /* work, in Kbytes */
+        case 2: n = g->gcatomicremarks; break;  /* remark passes before it */
+        default: n = 0; res = -1; break;
+      }
+      if (res == 0)
+        res = (n < cast(lu_mem, MAX_INT)) ? cast_int(n) : MAX_INT;
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -1162,6 +1350,44 @@ LUA_API void lua_len (lua_State *L, int idx) {
 }
 
 
+/*
+** Sort t[1..n] in place with '<' when that can be done natively (all
+** entries in the array part and all numbers or all strings); returns 0,
+** doing nothing, otherwise.
+*/
+LUA_API int lua_sortarray (lua_State *L, int idx, lua_Integer n) {
+  StkId t;
+  int res;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  api_check(L, ttistable(t), "table expected");
+  res = luaH_sortarray(L, hvalue(t), n);
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** Copy t1[f..e] into t2[t..] (as 'table.move') with raw moves, when both
+** ranges are in the array parts and neither table has the metamethods
+** that 'lua_geti' (for t1) or 'lua_seti' (for t2) could call; returns 0,
+** doing nothing, otherwise.
+*/
+LUA_API int lua_movearray (lua_State *L, int idx1, lua_Integer f,
+                           lua_Integer e, lua_Integer t, int idx2) {
+  StkId o1, o2;
+  int res = 0;
+  lua_lock(L);
+  o1 = index2addr(L, idx1);
+  o2 = index2addr(L, idx2);
+  api_check(L, ttistable(o1) && ttistable(o2), "table expected");
+  if (notm(L, hvalue(o1), TM_INDEX) && notm(L, hvalue(o2), TM_NEWINDEX))
+    res = luaH_movearray(L, hvalue(o1), f, e, hvalue(o2), t);
+  lua_unlock(L);
+  return res;
+}
+
+
 LUA_API lua_Alloc lua_getallocf (lua_State *L, void **ud) {
   lua_Alloc f;
   lua_lock(L);
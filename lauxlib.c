@@ -451,50 +451,10 @@ LUALIB_API lua_Integer luaL_optinteger (lua_State *L, int arg,
 ** =======================================================
 */
 
-/* userdata to box arbitrary data */
-typedef struct UBox {
-  void *box;
-  size_t bsize;
-} UBox;
-
-
-static void *resizebox (lua_State *L, int idx, size_t newsize) {
-  void *ud;
-  lua_Alloc allocf = lua_getallocf(L, &ud);
-  UBox *box = (UBox *)lua_touserdata(L, idx);
-  void *temp = allocf(ud, box->box, box->bsize, newsize);
-  if (temp == NULL && newsize > 0) {  /* allocation error? */
-    resizebox(L, idx, 0);  /* free buffer */
-    luaL_error(L, "not enough memory for buffer allocation");
-  }
-  box->box = temp;
-  box->bsize = newsize;
-  return temp;
-}
-
-
-static int boxgc (lua_State *L) {
-  resizebox(L, 1, 0);
-  return 0;
-}
-
-
-static void *newbox (lua_State *L, size_t newsize) {
-  UBox *box = (UBox *)lua_newuserdata(L, sizeof(UBox));
-  box->box = NULL;
-  box->bsize = 0;
-  if (luaL_newmetatable(L, "LUABOX")) {  /* creating metatable? */
-    lua_pushcfunction(L, boxgc);
-    lua_setfield(L, -2, "__gc");  /* metatable.__gc = boxgc */
-  }
-  lua_setmetatable(L, -2);
-  return resizebox(L, -1, newsize);
-}
-
-
 /*
-** check whether buffer is using a userdata on the stack as a temporary
-** buffer
+** check whether buffer is using an open string on the stack (see
+** 'lua_prepstring') as a temporary buffer; that string becomes the
+** final result, without another copy of its contents
 */
 #define buffonstack(B)	((B)->b != (B)->initb)
 
@@ -513,9 +473,9 @@ LUALIB_API char *luaL_prepbuffsize (luaL_Buffer *B, size_t sz) {
       luaL_error(L, "buffer too large");
     /* create larger buffer */
     if (buffonstack(B))
-      newbuff = (char *)resizebox(L, -1, newsize);
+      newbuff = lua_resizestring(L, -1, newsize);
     else {  /* no buffer yet */
-      newbuff = (char *)newbox(L, newsize);
+      newbuff = lua_prepstring(L, newsize);
       memcpy(newbuff, B->b, B->n * sizeof(char));  /* copy original content */
     }
     B->b = newbuff;
@@ -541,11 +501,10 @@ LUALIB_API void luaL_addstring (luaL_Buffer *B, const char *s) {
 
 LUALIB_API void luaL_pushresult (luaL_Buffer *B) {
   lua_State *L = B->L;
-  lua_pushlstring(L, B->b, B->n);
-  if (buffonstack(B)) {
-    resizebox(L, -2, 0);  /* delete old buffer */
-    lua_remove(L, -2);  /* remove its header from the stack */
-  }
+  if (buffonstack(B))
+    lua_finishstring(L, -1, B->n);  /* buffer becomes the result */
+  else
+    lua_pushlstring(L, B->b, B->n);
 }
 
 
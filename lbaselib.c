@@ -173,10 +173,11 @@ static int luaB_rawset (lua_State *L) {
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "setpause", "setstepmul",
-    "isrunning", NULL};
+    "isrunning", "setmaxpause", "setgrowth", "histogram", "atomic", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCISRUNNING};
+    LUA_GCISRUNNING, LUA_GCSETMAXPAUSE, LUA_GCSETGROWTH, LUA_GCSTEPHIST,
+    LUA_GCATOMICSTATS};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
   int ex = (int)luaL_optinteger(L, 2, 0);
   int res = lua_gc(L, o, ex);
@@ -190,6 +191,21 @@ static int luaB_collectgarbage (lua_State *L) {
       lua_pushboolean(L, res);
       return 1;
     }
+    case LUA_GCSTEPHIST: {  /* collect all classes in a table */
+      int i;
+      lua_newtable(L);
+      for (i = 0; (res = lua_gc(L, LUA_GCSTEPHIST, i)) >= 0; i++) {
+        lua_pushinteger(L, res);
+        lua_rawseti(L, -2, i + 1);
+      }
+      return 1;
+    }
+    case LUA_GCATOMICSTATS: {  /* duration, work, and remark passes */
+      int i;
+      for (i = 0; i < 3; i++)
+        lua_pushinteger(L, lua_gc(L, LUA_GCATOMICSTATS, i));
+      return 3;
+    }
     default: {
       lua_pushinteger(L, res);
       return 1;
@@ -168,6 +168,13 @@ static const char *findlocal (lua_State *L, CallInfo *ci, int n,
 }
 
 
+/*
+** An open string (see 'lua_prepstring') is still being written by its
+** C function, so it is not shown to, nor replaced by, other code.
+*/
+#define isopenstr(o)	(ttislngstring(o) && isstropen(tsvalue(o)))
+
+
 LUA_API const char *lua_getlocal (lua_State *L, const lua_Debug *ar, int n) {
   const char *name;
   lua_lock(L);
@@ -182,7 +189,10 @@ LUA_API const char *lua_getlocal (lua_State *L, const lua_Debug *ar, int n) {
     StkId pos = NULL;  /* to avoid warnings */
     name = findlocal(L, ar->i_ci, n, &pos);
     if (name) {
-      setobj2s(L, L->top, pos);
+      if (isopenstr(pos))
+        setnilvalue(L->top);
+      else
+        setobj2s(L, L->top, pos);
       api_incr_top(L);
     }
   }
@@ -199,7 +209,8 @@ LUA_API const char *lua_setlocal (lua_State *L, const lua_Debug *ar, int n) {
   swapextra(L);
   name = findlocal(L, ar->i_ci, n, &pos);
   if (name) {
-    setobjs2s(L, pos, L->top - 1);
+    if (!isopenstr(pos))
+      setobjs2s(L, pos, L->top - 1);
     L->top--;  /* pop value */
   }
   swapextra(L);
@@ -59,6 +59,27 @@
 #define PAUSEADJ		100
 
 
+/*
+** maximum number of remark passes over list 'grayagain' before the
+** atomic phase (see 'finishpropagate')
+*/
+#if !defined(GCMAXREMARK)
+#define GCMAXREMARK	3
+#endif
+
+
+/*
+** clock used by the timed pacer: current time in microseconds (any
+** origin). The default uses processor time; a host may define it with
+** a wall clock.
+*/
+#if !defined(luai_gcclock)
+#include <time.h>
+#define luai_gcclock()  \
+	cast(l_mem, cast(double, clock()) * (1000000.0 / CLOCKS_PER_SEC))
+#endif
+
+
 /*
 ** 'makewhite' erases all color bits then sets only the current white
 ** bit
@@ -92,6 +113,247 @@
 #define markobjectN(g,t)	{ if (t) markobject(g,t); }
 
 static void reallymarkobject (global_State *g, GCObject *o);
+static void ephaddentry (global_State *g, GCObject *key, const TValue *value);
+static void ephkeymarked (global_State *g, GCObject *o);
+
+
+#if defined(LUAI_GCPAGES)
+
+/*
+** {======================================================
+** Paged heap
+** =======================================================
+*/
+
+/* size class for objects with size 'sz' */
+#define sizeclass(sz)	cast_int(((sz) - 1) >> GCGRAINBITS)
+
+/* size of the block allocated for a chunk (see 'newchunk') */
+#define CHUNKBLOCKSIZE	((GCCHUNKPAGES + 1) * GCPAGESIZE)
+
+/* mark a paged object as kept in some other list (or not) */
+#define setkeep(o)	gcsetpagebit(gcpageof(o)->keep, gcslotbit(gcpageof(o), o))
+#define clearkeep(o)	gcclrpagebit(gcpageof(o)->keep, gcslotbit(gcpageof(o), o))
+
+
+/*
+** Link page 'p' in the list of pages with free slots of its class
+*/
+static void linkfreepage (global_State *g, GCPage *p) {
+  GCPage **list = &g->freepages[sizeclass(p->objsize)];
+  p->prevfree = NULL;
+  p->nextfree = *list;
+  if (*list != NULL)
+    (*list)->prevfree = p;
+  *list = p;
+}
+
+
+static void unlinkfreepage (global_State *g, GCPage *p) {
+  if (p->prevfree != NULL)
+    p->prevfree->nextfree = p->nextfree;
+  else
+    g->freepages[sizeclass(p->objsize)] = p->nextfree;
+  if (p->nextfree != NULL)
+    p->nextfree->prevfree = p->prevfree;
+}
+
+
+static void linkchunk (global_State *g, GCChunk *c) {
+  c->prev = NULL;
+  c->next = g->chunks;
+  if (g->chunks != NULL)
+    g->chunks->prev = c;
+  g->chunks = c;
+}
+
+
+static void unlinkchunk (global_State *g, GCChunk *c) {
+  if (c->prev != NULL)
+    c->prev->next = c->next;
+  else
+    g->chunks = c->next;
+  if (c->next != NULL)
+    c->next->prev = c->prev;
+}
+
+
+/*
+** Allocate a new chunk, with all its pages free. The block for the
+** chunk has one extra page, so that pages can be aligned to their
+** size; the chunk header goes into the unused space, either before or
+** after the pages. If the allocation fails, try an emergency collection,
+** which may free some pages.
+*/
+static void newchunk (lua_State *L) {
+  global_State *g = G(L);
+  char *block = cast(char *, (*g->frealloc)(g->ud, NULL, 0, CHUNKBLOCKSIZE));
+  char *pages;
+  GCChunk *c;
+  int i;
+  if (block == NULL) {
+    if (g->version) {  /* is state fully built? */
+      luaC_fullgc(L, 1);  /* try to free some memory... */
+      if (g->chunks != NULL)  /* collection released some pages? */
+        return;  /* that is enough */
+      block = cast(char *, (*g->frealloc)(g->ud, NULL, 0, CHUNKBLOCKSIZE));
+    }
+    if (block == NULL)
+      luaD_throw(L, LUA_ERRMEM);
+  }
+  pages = block + ((GCPAGESIZE - (cast(size_t, block) & (GCPAGESIZE - 1)))
+                   & (GCPAGESIZE - 1));
+  if (cast(size_t, pages - block) >= sizeof(GCChunk))
+    c = cast(GCChunk *, block);
+  else
+    c = cast(GCChunk *, pages + GCCHUNKPAGES * GCPAGESIZE);
+  c->block = block;
+  c->freepage = NULL;
+  for (i = GCCHUNKPAGES - 1; i >= 0; i--) {
+    GCPage *p = cast(GCPage *, pages + i * GCPAGESIZE);
+    p->chunk = c;
+    p->next = c->freepage;
+    c->freepage = p;
+  }
+  c->nfree = GCCHUNKPAGES;
+  linkchunk(g, c);
+}
+
+
+/*
+** Get a free page and format it for objects of class 'cls'. New pages
+** do not need to be swept in a sweep phase already running.
+*/
+static GCPage *newpage (lua_State *L, int cls) {
+  global_State *g = G(L);
+  GCChunk *c;
+  GCPage *p;
+  int i;
+  if (g->chunks == NULL)  /* no free pages? */
+    newchunk(L);
+  c = g->chunks;
+  p = c->freepage;
+  c->freepage = p->next;
+  if (--c->nfree == 0)  /* no more free pages in this chunk? */
+    unlinkchunk(g, c);
+  p->objsize = cast(unsigned short, (cls + 1) * GCPAGEGRAIN);
+  p->nslots = cast(unsigned short, (GCPAGESIZE - GCPAGEHEADER) / p->objsize);
+  p->nused = 0;
+  p->sweepmark = g->pagesweepmark;
+  memset(p->alloc, 0, sizeof(p->alloc));
+  memset(p->mark, 0, sizeof(p->mark));
+  memset(p->keep, 0, sizeof(p->keep));
+  p->freeslot = NULL;
+  for (i = p->nslots - 1; i >= 0; i--) {  /* build list of free slots */
+    void **slot = cast(void **, cast(char *, p) + GCPAGEHEADER +
+                                cast(size_t, i) * p->objsize);
+    *slot = p->freeslot;
+    p->freeslot = slot;
+  }
+  p->next = g->pages;  /* link page in list of all pages */
+  g->pages = p;
+  linkfreepage(g, p);
+  return p;
+}
+
+
+/*
+** Return an empty page to its chunk; return the chunk to the
+** allocation function when all its pages are free. (Page must be
+** already removed from list 'pages'.)
+*/
+static void releasepage (global_State *g, GCPage *p) {
+  GCChunk *c = p->chunk;
+  lua_assert(p->nused == 0);
+  unlinkfreepage(g, p);  /* an empty page is always in that list */
+  p->next = c->freepage;
+  c->freepage = p;
+  if (c->nfree++ == 0)  /* chunk had no free pages? */
+    linkchunk(g, c);
+  if (c->nfree == GCCHUNKPAGES) {  /* all its pages are free? */
+    unlinkchunk(g, c);
+    (*g->frealloc)(g->ud, c->block, CHUNKBLOCKSIZE, 0);
+  }
+}
+
+
+/*
+** Allocate a slot for an object with size 'sz' in a page of the
+** corresponding class. If the page was not swept yet in the current
+** sweep phase, the new object gets its mark bit, so that it survives
+** that sweep. Each object counts its slot size as allocated memory.
+*/
+static GCObject *pagealloc (lua_State *L, size_t sz) {
+  global_State *g = G(L);
+  int cls = sizeclass(sz);
+  GCPage *p;
+  GCObject *o;
+  int b;
+#if defined(HARDMEMTESTS)
+  if (g->gcrunning)
+    luaC_fullgc(L, 1);  /* force a GC whenever possible */
+#endif
+  p = g->freepages[cls];
+  if (p == NULL)
+    p = newpage(L, cls);
+  o = cast(GCObject *, p->freeslot);
+  p->freeslot = *cast(void **, o);
+  if (++p->nused == p->nslots)  /* page is full? */
+    unlinkfreepage(g, p);
+  b = gcslotbit(p, o);
+  gcsetpagebit(p->alloc, b);
+  if (issweepphase(g) && gcpendingpage(g, p))
+    gcsetpagebit(p->mark, b);
+  o->marked = cast_byte(luaC_white(g) | bitmask(PAGEDBIT));
+  g->GCdebt += p->objsize;
+  return o;
+}
+
+
+/*
+** Free the memory of a collectable object. Paged objects give their
+** slots back to their pages.
+*/
+void luaC_freegco (lua_State *L, GCObject *o, size_t sz) {
+  if (!ispaged(o))
+    luaM_freemem(L, o, sz);
+  else {
+    global_State *g = G(L);
+    GCPage *p = gcpageof(o);
+    int b = gcslotbit(p, o);
+    lua_assert(sz <= p->objsize && gctstpagebit(p->alloc, b));
+    UNUSED(sz);
+    gcclrpagebit(p->alloc, b);
+    gcclrpagebit(p->mark, b);
+    gcclrpagebit(p->keep, b);
+    *cast(void **, o) = p->freeslot;
+    p->freeslot = o;
+    if (p->nused-- == p->nslots)  /* page was full? */
+      linkfreepage(g, p);
+    g->GCdebt -= p->objsize;
+  }
+}
+
+
+/*
+** Give a mark to every object in every page, so that the next sweep
+** does not collect anything.
+*/
+static void markallpages (global_State *g) {
+  GCPage *p;
+  for (p = g->pages; p != NULL; p = p->next)
+    memcpy(p->mark, p->alloc, sizeof(p->mark));
+}
+
+/* }====================================================== */
+
+#else
+
+#define setkeep(o)	lua_assert(0)
+#define clearkeep(o)	lua_assert(0)
+
+#endif
+
 
 
 /*
@@ -102,9 +364,19 @@ static void reallymarkobject (global_State *g, GCObject *o);
 
 
 /*
-** one after last element in a hash array
+** Hash nodes of a table: part 0 is the current hash part; during an
+** incremental rehash (see 'ltable.c'), part 1 has the old nodes, which
+** must be traversed and cleared like the current ones.
 */
-#define gnodelast(h)	gnode(h, cast(size_t, sizenode(h)))
+#define gnodeparts(h)	((h)->old == NULL ? 1 : 2)
+
+/* first element of a part of a hash array */
+#define gnodefirst(h,r)	((r) == 0 ? gnode(h, 0) : (h)->old->node)
+
+/* one after last element of a part of a hash array */
+#define gnodelast(h,r)  \
+	((r) == 0 ? gnode(h, cast(size_t, sizenode(h))) : \
+	            (h)->old->node + (h)->old->size)
 
 
 /*
@@ -193,9 +465,13 @@ void luaC_upvalbarrier_ (lua_State *L, UpVal *uv) {
 
 void luaC_fix (lua_State *L, GCObject *o) {
   global_State *g = G(L);
-  lua_assert(g->allgc == o);  /* object must be 1st in 'allgc' list! */
   white2gray(o);  /* they will be gray forever */
-  g->allgc = o->next;  /* remove object from 'allgc' list */
+  if (ispaged(o))  /* not in 'allgc' list? */
+    setkeep(o);  /* page sweep must skip it */
+  else {
+    lua_assert(g->allgc == o);  /* object must be 1st in 'allgc' list! */
+    g->allgc = o->next;  /* remove object from 'allgc' list */
+  }
   o->next = g->fixedgc;  /* link it to 'fixedgc' list */
   g->fixedgc = o;
 }
@@ -203,11 +479,21 @@ void luaC_fix (lua_State *L, GCObject *o) {
 
 /*
 ** create a new collectable object (with given type and size) and link
-** it to 'allgc' list.
+** it to 'allgc' list. (Small objects in a paged heap go to a page
+** instead.)
 */
 GCObject *luaC_newobj (lua_State *L, int tt, size_t sz) {
   global_State *g = G(L);
-  GCObject *o = cast(GCObject *, luaM_newobject(L, novariant(tt), sz));
+  GCObject *o;
+#if defined(LUAI_GCPAGES)
+  if (sz <= GCPAGEMAXOBJ) {
+    o = pagealloc(L, sz);
+    o->tt = tt;
+    o->next = NULL;
+    return o;
+  }
+#endif
+  o = cast(GCObject *, luaM_newobject(L, novariant(tt), sz));
   o->marked = luaC_white(g);
   o->tt = tt;
   o->next = g->allgc;
@@ -235,6 +521,10 @@ GCObject *luaC_newobj (lua_State *L, int tt, size_t sz) {
 static void reallymarkobject (global_State *g, GCObject *o) {
  reentry:
   white2gray(o);
+  luaC_markpaged(o);
+  g->gcnmarked++;
+  if (g->ephmap != NULL)  /* converging ephemerons? */
+    ephkeymarked(g, o);  /* 'o' may be a key of pending entries */
   switch (o->tt) {
     case LUA_TSHRSTR: {
       gray2black(o);
@@ -242,8 +532,13 @@ static void reallymarkobject (global_State *g, GCObject *o) {
       break;
     }
     case LUA_TLNGSTR: {
+      TString *ts = gco2ts(o);
       gray2black(o);
-      g->GCmemtrav += sizelstring(gco2ts(o)->u.lnglen);
+      g->GCmemtrav += sizelngstr(ts);
+      if (isstrview(ts) && iswhite(getstrref(ts)->parent)) {
+        o = obj2gco(getstrref(ts)->parent);  /* a view keeps its parent */
+        goto reentry;
+      }
       break;
     }
     case LUA_TUSERDATA: {
@@ -331,12 +626,34 @@ static void remarkupvals (global_State *g) {
 }
 
 
+/*
+** Mark values of open upvalues touched by marked closures whose
+** threads are not marked yet. Unlike 'remarkupvals', it does not
+** change the list nor the upvalues, so that the atomic phase still
+** checks them; it only anticipates that work.
+*/
+static void premarkupvals (global_State *g) {
+  lua_State *thread;
+  for (thread = g->twups; thread != NULL; thread = thread->twups) {
+    if (iswhite(thread)) {
+      UpVal *uv;
+      for (uv = thread->openupval; uv != NULL; uv = uv->u.open.next) {
+        if (uv->u.open.touched)
+          markvalue(g, uv->v);
+      }
+    }
+  }
+}
+
+
 /*
 ** mark root set and reset all gray lists, to start a new collection
 */
 static void restartcollection (global_State *g) {
   g->gray = g->grayagain = NULL;
   g->weak = g->allweak = g->ephemeron = NULL;
+  g->gcnmarked = 0;
+  g->gcremarks = 0;
   markobject(g, g->mainthread);
   markvalue(g, &g->l_registry);
   markmt(g);
@@ -359,11 +676,13 @@ static void restartcollection (global_State *g) {
 ** put it in 'weak' list, to be cleared.
 */
 static void traverseweakvalue (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
+  Node *n, *limit;
+  int r;
   /* if there is array part, assume it may have white values (it is not
      worth traversing it now just to check) */
   int hasclears = (h->sizearray > 0);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
+  for (r = 0; r < gnodeparts(h); r++)
+  for (n = gnodefirst(h, r), limit = gnodelast(h, r); n < limit; n++) {
     checkdeadkey(n);
     if (ttisnil(gval(n)))  /* entry is empty? */
       removeentry(n);  /* remove it */
@@ -395,8 +714,9 @@ static int traverseephemeron (global_State *g, Table *h) {
   int marked = 0;  /* true if an object is marked in this traversal */
   int hasclears = 0;  /* true if table has white keys */
   int hasww = 0;  /* true if table has entry "white-key -> white-value" */
-  Node *n, *limit = gnodelast(h);
+  Node *n, *limit;
   unsigned int i;
+  int r;
   /* traverse array part */
   for (i = 0; i < h->sizearray; i++) {
     if (valiswhite(&h->array[i])) {
@@ -405,14 +725,18 @@ static int traverseephemeron (global_State *g, Table *h) {
     }
   }
   /* traverse hash part */
-  for (n = gnode(h, 0); n < limit; n++) {
+  for (r = 0; r < gnodeparts(h); r++)
+  for (n = gnodefirst(h, r), limit = gnodelast(h, r); n < limit; n++) {
     checkdeadkey(n);
     if (ttisnil(gval(n)))  /* entry is empty? */
       removeentry(n);  /* remove it */
     else if (iscleared(g, gkey(n))) {  /* key is not marked (yet)? */
       hasclears = 1;  /* table must be cleared */
-      if (valiswhite(gval(n)))  /* value not marked yet? */
+      if (valiswhite(gval(n))) {  /* value not marked yet? */
         hasww = 1;  /* white-white entry */
+        if (g->ephmap != NULL)  /* converging ephemerons? */
+          ephaddentry(g, gcvalue(gkey(n)), gval(n));  /* wait for key */
+      }
     }
     else if (valiswhite(gval(n))) {  /* value not marked yet? */
       marked = 1;
@@ -431,11 +755,13 @@ static int traverseephemeron (global_State *g, Table *h) {
 
 
 static void traversestrongtable (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
+  Node *n, *limit;
   unsigned int i;
+  int r;
   for (i = 0; i < h->sizearray; i++)  /* traverse array part */
     markvalue(g, &h->array[i]);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
+  for (r = 0; r < gnodeparts(h); r++)  /* traverse hash part */
+  for (n = gnodefirst(h, r), limit = gnodelast(h, r); n < limit; n++) {
     checkdeadkey(n);
     if (ttisnil(gval(n)))  /* entry is empty? */
       removeentry(n);  /* remove it */
@@ -453,8 +779,8 @@ static lu_mem traversetable (global_State *g, Table *h) {
   const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
   markobjectN(g, h->metatable);
   if (mode && ttisstring(mode) &&  /* is there a weak mode? */
-      ((weakkey = strchr(svalue(mode), 'k')),
-       (weakvalue = strchr(svalue(mode), 'v')),
+      ((weakkey = cast(const char *, memchr(svalue(mode), 'k', vslen(mode)))),
+       (weakvalue = cast(const char *, memchr(svalue(mode), 'v', vslen(mode)))),
        (weakkey || weakvalue))) {  /* is really weak? */
     black2gray(h);  /* keep table gray */
     if (!weakkey)  /* strong keys? */
@@ -467,7 +793,8 @@ static lu_mem traversetable (global_State *g, Table *h) {
   else  /* not weak */
     traversestrongtable(g, h);
   return sizeof(Table) + sizeof(TValue) * h->sizearray +
-                         sizeof(Node) * cast(size_t, allocsizenode(h));
+                         sizeof(Node) * cast(size_t, allocsizenode(h)) +
+                         sizeof(Node) * cast(size_t, oldsizenode(h));
 }
 
 
@@ -605,11 +932,212 @@ static void propagateall (global_State *g) {
 }
 
 
+/*
+** Called when the gray list becomes empty in the propagate phase.
+** Objects in 'grayagain' (threads, weak tables, and tables caught by
+** back barriers) would all be traversed again by the atomic phase,
+** together with everything they reach. If the last pass marked new
+** objects, make another incremental pass over them, so that the
+** atomic phase finds most of that work done (and ephemeron tables
+** mostly converged).
+*/
+static void finishpropagate (global_State *g) {
+  if (g->gcnmarked > 0 && g->grayagain != NULL &&
+      g->gcremarks < GCMAXREMARK) {
+    g->gcremarks++;
+    g->gcnmarked = 0;
+    g->gray = g->grayagain;  /* traverse them again */
+    g->grayagain = NULL;
+    premarkupvals(g);
+    return;  /* continue propagating */
+  }
+  g->gcstate = GCSatomic;
+}
+
+
+/*
+** {======================================================
+** Ephemeron convergence
+** While converging ephemerons in the atomic phase, white->white entries
+** are kept in a hash table indexed by their keys. When one of those
+** keys is marked, its entries go to a list of "ready" entries, whose
+** values must be marked. So, each ephemeron table is traversed once
+** and each entry is handled a bounded number of times, instead of
+** traversing all ephemeron tables again until nothing changes. The
+** structure exists only inside the atomic phase, so it is allocated
+** directly with 'frealloc'; if an allocation fails, the collector
+** falls back to repeated traversals.
+** =======================================================
+*/
+
+typedef struct EphEntry {
+  GCObject *key;
+  const TValue *value;
+  int next;  /* next entry in the same bucket or in list 'ready' */
+} EphEntry;
+
+
+typedef struct EphMap {
+  EphEntry *entry;  /* array of entries */
+  int *bucket;  /* heads of hash chains */
+  int size;  /* size of both arrays (a power of 2) */
+  int nentry;  /* number of entries in use in array 'entry' */
+  int ready;  /* list of entries whose keys were marked */
+  int failed;  /* true if some allocation failed */
+} EphMap;
+
+
+#define EPHMINSIZE	64
+
+/*
+** Bucket for object 'o' in a map with 'size' buckets. Objects are
+** aligned, so the low bits of their addresses are mixed with higher
+** ones instead of being used directly.
+*/
+#define ephhash(o,size)  \
+	(((point2uint(o) >> 4) ^ (point2uint(o) >> 12)) % \
+	 cast(unsigned int, size))
+
+#define ephbucket(m,o)	ephhash(o, (m)->size)
+
+
+/*
+** Double the size of the map (or create it), rehashing the entries
+** still waiting for their keys
+*/
+static int ephgrow (global_State *g, EphMap *m) {
+  int oldsize = m->size;
+  int newsize = (oldsize == 0) ? EPHMINSIZE : oldsize * 2;
+  EphEntry *e;
+  int *b;
+  int i;
+  if (newsize > MAX_INT / cast_int(sizeof(EphEntry)))
+    return 0;
+  b = cast(int *, (*g->frealloc)(g->ud, NULL, 0, newsize * sizeof(int)));
+  if (b == NULL)
+    return 0;
+  e = cast(EphEntry *, (*g->frealloc)(g->ud, m->entry,
+                                      oldsize * sizeof(EphEntry),
+                                      newsize * sizeof(EphEntry)));
+  if (e == NULL) {
+    (*g->frealloc)(g->ud, b, newsize * sizeof(int), 0);
+    return 0;
+  }
+  m->entry = e;
+  for (i = 0; i < newsize; i++)
+    b[i] = -1;
+  for (i = 0; i < oldsize; i++) {  /* move chains to new buckets */
+    int j = m->bucket[i];
+    while (j != -1) {
+      int next = e[j].next;
+      unsigned int h = ephhash(e[j].key, newsize);
+      e[j].next = b[h];
+      b[h] = j;
+      j = next;
+    }
+  }
+  if (m->bucket != NULL)
+    (*g->frealloc)(g->ud, m->bucket, oldsize * sizeof(int), 0);
+  m->bucket = b;
+  m->size = newsize;
+  return 1;
+}
+
+
+/*
+** Entry with white key 'key' and white value 'value' must wait for its
+** key to be marked
+*/
+static void ephaddentry (global_State *g, GCObject *key,
+                                          const TValue *value) {
+  EphMap *m = g->ephmap;
+  EphEntry *e;
+  unsigned int h;
+  if (m->failed)
+    return;  /* repeated traversals will handle it */
+  if (m->nentry == m->size && !ephgrow(g, m)) {
+    m->failed = 1;
+    return;
+  }
+  e = &m->entry[m->nentry];
+  h = ephbucket(m, key);
+  e->key = key;
+  e->value = value;
+  e->next = m->bucket[h];
+  m->bucket[h] = m->nentry++;
+}
+
+
+/*
+** Object 'o' has just been marked: move all entries with key 'o' to
+** list 'ready'
+*/
+static void ephkeymarked (global_State *g, GCObject *o) {
+  EphMap *m = g->ephmap;
+  int *p;
+  if (m->size == 0)
+    return;  /* no entries */
+  p = &m->bucket[ephbucket(m, o)];
+  while (*p != -1) {
+    EphEntry *e = &m->entry[*p];
+    if (e->key == o) {
+      int j = *p;
+      *p = e->next;  /* remove entry from its chain */
+      e->next = m->ready;  /* insert it in list 'ready' */
+      m->ready = j;
+    }
+    else
+      p = &e->next;
+  }
+}
+
+
+/*
+** Mark values of ready entries (which may turn other entries ready)
+*/
+static void ephmarkready (global_State *g, EphMap *m) {
+  for (;;) {
+    propagateall(g);
+    if (m->ready == -1)
+      break;
+    else {
+      EphEntry *e = &m->entry[m->ready];
+      m->ready = e->next;
+      if (valiswhite(e->value))
+        reallymarkobject(g, gcvalue(e->value));
+    }
+  }
+}
+
+
 static void convergeephemerons (global_State *g) {
   int changed;
-  do {
-    GCObject *w;
-    GCObject *next = g->ephemeron;  /* get ephemeron list */
+  EphMap m;
+  GCObject *w;
+  GCObject *next = g->ephemeron;  /* get ephemeron list */
+  lua_assert(g->ephmap == NULL && g->gcstate == GCSinsideatomic);
+  if (next == NULL)
+    return;  /* nothing to converge */
+  m.entry = NULL; m.bucket = NULL;
+  m.size = m.nentry = 0;
+  m.ready = -1;
+  m.failed = 0;
+  g->ephmap = &m;
+  g->ephemeron = NULL;  /* tables may return to this list when traversed */
+  while ((w = next) != NULL) {
+    next = gco2t(w)->gclist;
+    traverseephemeron(g, gco2t(w));  /* registers white->white entries */
+    ephmarkready(g, &m);  /* propagate changes */
+  }
+  g->ephmap = NULL;
+  if (m.entry != NULL)
+    (*g->frealloc)(g->ud, m.entry, m.size * sizeof(EphEntry), 0);
+  if (m.bucket != NULL)
+    (*g->frealloc)(g->ud, m.bucket, m.size * sizeof(int), 0);
+  if (!m.failed)
+    return;  /* all entries converged */
+  do {  /* else repeat traversals until nothing changes */
+    next = g->ephemeron;  /* get ephemeron list */
     g->ephemeron = NULL;  /* tables may return to this list when traversed */
     changed = 0;
     while ((w = next) != NULL) {
@@ -639,8 +1167,10 @@ static void convergeephemerons (global_State *g) {
 static void clearkeys (global_State *g, GCObject *l, GCObject *f) {
   for (; l != f; l = gco2t(l)->gclist) {
     Table *h = gco2t(l);
-    Node *n, *limit = gnodelast(h);
-    for (n = gnode(h, 0); n < limit; n++) {
+    Node *n, *limit;
+    int r;
+    for (r = 0; r < gnodeparts(h); r++)
+    for (n = gnodefirst(h, r), limit = gnodelast(h, r); n < limit; n++) {
       if (!ttisnil(gval(n)) && (iscleared(g, gkey(n)))) {
         setnilvalue(gval(n));  /* remove value ... */
         removeentry(n);  /* and remove entry from table */
@@ -657,14 +1187,16 @@ static void clearkeys (global_State *g, GCObject *l, GCObject *f) {
 static void clearvalues (global_State *g, GCObject *l, GCObject *f) {
   for (; l != f; l = gco2t(l)->gclist) {
     Table *h = gco2t(l);
-    Node *n, *limit = gnodelast(h);
+    Node *n, *limit;
     unsigned int i;
+    int r;
     for (i = 0; i < h->sizearray; i++) {
       TValue *o = &h->array[i];
       if (iscleared(g, o))  /* value was collected? */
         setnilvalue(o);  /* remove value */
     }
-    for (n = gnode(h, 0); n < limit; n++) {
+    for (r = 0; r < gnodeparts(h); r++)
+    for (n = gnodefirst(h, r), limit = gnodelast(h, r); n < limit; n++) {
       if (!ttisnil(gval(n)) && iscleared(g, gval(n))) {
         setnilvalue(gval(n));  /* remove value ... */
         removeentry(n);  /* and remove entry from table */
@@ -689,7 +1221,7 @@ static void freeLclosure (lua_State *L, LClosure *cl) {
     if (uv)
       luaC_upvdeccount(L, uv);
   }
-  luaM_freemem(L, cl, sizeLclosure(cl->nupvalues));
+  luaC_freegco(L, obj2gco(cl), sizeLclosure(cl->nupvalues));
 }
 
 
@@ -701,18 +1233,18 @@ static void freeobj (lua_State *L, GCObject *o) {
       break;
     }
     case LUA_TCCL: {
-      luaM_freemem(L, o, sizeCclosure(gco2ccl(o)->nupvalues));
+      luaC_freegco(L, o, sizeCclosure(gco2ccl(o)->nupvalues));
       break;
     }
     case LUA_TTABLE: luaH_free(L, gco2t(o)); break;
     case LUA_TTHREAD: luaE_freethread(L, gco2th(o)); break;
-    case LUA_TUSERDATA: luaM_freemem(L, o, sizeudata(gco2u(o))); break;
+    case LUA_TUSERDATA: luaC_freegco(L, o, sizeudata(gco2u(o))); break;
     case LUA_TSHRSTR:
       luaS_remove(L, gco2ts(o));  /* remove it from hash table */
-      luaM_freemem(L, o, sizelstring(gco2ts(o)->shrlen));
+      luaC_freegco(L, o, sizelstring(gco2ts(o)->shrlen));
       break;
     case LUA_TLNGSTR: {
-      luaM_freemem(L, o, sizelstring(gco2ts(o)->u.lnglen));
+      luaS_freelngstr(L, gco2ts(o));
       break;
     }
     default: lua_assert(0);
@@ -762,6 +1294,94 @@ static GCObject **sweeptolive (lua_State *L, GCObject **p) {
   return p;
 }
 
+
+#if defined(LUAI_GCPAGES)
+
+/*
+** sweep a heap page: objects in use that are not marked (and not kept
+** in other lists, which are swept separately) are dead; the other
+** ones get the current white. The page is left with no marks. Return
+** the number of objects visited.
+*/
+static int sweeppage (lua_State *L, GCPage *p) {
+  global_State *g = G(L);
+  int white = luaC_white(g);
+  int count = 0;
+  int w;
+  for (w = 0; w < cast_int(GCPAGEWORDS); w++) {
+    unsigned int inuse = p->alloc[w] & ~p->keep[w];
+    unsigned int dead = inuse & ~p->mark[w];
+    unsigned int live = inuse & p->mark[w];
+    p->mark[w] = 0;
+    for (; dead != 0; dead &= dead - 1, count++) {
+      int b = w * GCWORDBITS + luaO_ceillog2(dead & (~dead + 1));
+      GCObject *curr = gcbitslot(p, b);
+      lua_assert(isdead(g, curr));
+      freeobj(L, curr);
+    }
+    for (; live != 0; live &= live - 1, count++) {
+      int b = w * GCWORDBITS + luaO_ceillog2(live & (~live + 1));
+      GCObject *curr = gcbitslot(p, b);
+      lua_assert(!isdead(g, curr));
+      curr->marked = cast_byte((curr->marked & maskcolors) | white);
+    }
+  }
+  p->sweepmark = g->pagesweepmark;
+  return count;
+}
+
+
+/*
+** sweep pages until visiting about 'GCSWEEPMAX' objects; pages that
+** become empty go back to their chunks. (Pages created after the
+** start of this sweep phase need no sweep.)
+*/
+static lu_mem sweeppages (lua_State *L, global_State *g) {
+  l_mem olddebt = g->GCdebt;
+  int count = 0;
+  GCPage *p;
+  while (count < GCSWEEPMAX && (p = *g->sweeppage) != NULL) {
+    if (gcpendingpage(g, p))
+      count += sweeppage(L, p);
+    if (p->nused == 0) {  /* page is empty? */
+      *g->sweeppage = p->next;  /* remove it from list 'pages' */
+      releasepage(g, p);
+    }
+    else
+      g->sweeppage = &p->next;
+    count++;
+  }
+  if (*g->sweeppage == NULL)  /* all pages swept? */
+    g->sweeppage = NULL;
+  g->GCestimate += g->GCdebt - olddebt;  /* update estimate */
+  return count * GCSWEEPCOST;
+}
+
+
+/*
+** free all objects in pages (except the ones in 'fixedgc', if 'all'
+** is false) and then all pages. Used when closing the state.
+*/
+static void freeallpages (lua_State *L, int all) {
+  global_State *g = G(L);
+  GCPage *p;
+  if (!all) {
+    for (p = g->pages; p != NULL; p = p->next) {
+      memset(p->mark, 0, sizeof(p->mark));  /* everything is dead */
+      sweeppage(L, p);
+    }
+  }
+  else {
+    while ((p = g->pages) != NULL) {
+      g->pages = p->next;
+      releasepage(g, p);
+    }
+    lua_assert(g->chunks == NULL);
+  }
+}
+
+#endif
+
 /* }====================================================== */
 
 
@@ -788,8 +1408,14 @@ static GCObject *udata2finalize (global_State *g) {
   GCObject *o = g->tobefnz;  /* get first element */
   lua_assert(tofinalize(o));
   g->tobefnz = o->next;  /* remove it from 'tobefnz' list */
-  o->next = g->allgc;  /* return it to 'allgc' list */
-  g->allgc = o;
+  if (ispaged(o)) {  /* it belongs only to its page */
+    clearkeep(o);
+    o->next = NULL;
+  }
+  else {
+    o->next = g->allgc;  /* return it to 'allgc' list */
+    g->allgc = o;
+  }
   resetbit(o->marked, FINALIZEDBIT);  /* object is "normal" again */
   if (issweepphase(g))
     makewhite(g, o);  /* "sweep" object */
@@ -826,7 +1452,7 @@ static void GCTM (lua_State *L, int propagateerrors) {
     if (status != LUA_OK && propagateerrors) {  /* error while running __gc? */
       if (status == LUA_ERRRUN) {  /* is there an error object? */
         const char *msg = (ttisstring(L->top - 1))
-                            ? svalue(L->top - 1)
+                            ? luaS_tocstr(L, tsvalue(L->top - 1))
                             : "no message";
         luaO_pushfstring(L, "error in __gc metamethod (%s)", msg);
         status = LUA_ERRGCMM;  /* error in __gc metamethod */
@@ -910,9 +1536,13 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
       if (g->sweepgc == &o->next)  /* should not remove 'sweepgc' object */
         g->sweepgc = sweeptolive(L, g->sweepgc);  /* change 'sweepgc' */
     }
-    /* search for pointer pointing to 'o' */
-    for (p = &g->allgc; *p != o; p = &(*p)->next) { /* empty */ }
-    *p = o->next;  /* remove 'o' from 'allgc' list */
+    if (ispaged(o))  /* not in 'allgc' list? */
+      setkeep(o);  /* page sweep must skip it */
+    else {
+      /* search for pointer pointing to 'o' */
+      for (p = &g->allgc; *p != o; p = &(*p)->next) { /* empty */ }
+      *p = o->next;  /* remove 'o' from 'allgc' list */
+    }
     o->next = g->finobj;  /* link it in 'finobj' list */
     g->finobj = o;
     l_setbit(o->marked, FINALIZEDBIT);  /* mark it as such */
@@ -939,9 +1569,12 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
 static void setpause (global_State *g) {
   l_mem threshold, debt;
   l_mem estimate = g->GCestimate / PAUSEADJ;  /* adjust 'estimate' */
+  int pause = (g->gcmaxpause > 0)  /* timed pacer? */
+            ? PAUSEADJ + (g->gcgrowth - PAUSEADJ) / 2  /* half the growth */
+            : g->gcpause;
   lua_assert(estimate > 0);
-  threshold = (g->gcpause < MAX_LMEM / estimate)  /* overflow? */
-            ? estimate * g->gcpause  /* no overflow */
+  threshold = (pause < MAX_LMEM / estimate)  /* overflow? */
+            ? estimate * pause  /* no overflow */
             : MAX_LMEM;  /* overflow; truncate to maximum */
   debt = gettotalbytes(g) - threshold;
   luaE_setdebt(g, debt);
@@ -960,6 +1593,11 @@ static void entersweep (lua_State *L) {
   g->gcstate = GCSswpallgc;
   lua_assert(g->sweepgc == NULL);
   g->sweepgc = sweeplist(L, &g->allgc, 1);
+#if defined(LUAI_GCPAGES)
+  lua_assert(g->sweeppage == NULL);
+  g->pagesweepmark ^= 1;  /* all pages need a sweep */
+  g->sweeppage = &g->pages;
+#endif
 }
 
 
@@ -973,7 +1611,13 @@ void luaC_freeallobjects (lua_State *L) {
   g->gckind = KGC_NORMAL;
   sweepwholelist(L, &g->finobj);
   sweepwholelist(L, &g->allgc);
+#if defined(LUAI_GCPAGES)
+  freeallpages(L, 0);
+#endif
   sweepwholelist(L, &g->fixedgc);  /* collect fixed objects */
+#if defined(LUAI_GCPAGES)
+  freeallpages(L, 1);
+#endif
   lua_assert(g->strt.nuse == 0);
 }
 
@@ -1054,19 +1698,27 @@ static lu_mem singlestep (lua_State *L) {
       g->GCmemtrav = 0;
       lua_assert(g->gray);
       propagatemark(g);
-       if (g->gray == NULL)  /* no more gray objects? */
-        g->gcstate = GCSatomic;  /* finish propagate phase */
+      if (g->gray == NULL)  /* no more gray objects? */
+        finishpropagate(g);  /* maybe finish propagate phase */
       return g->GCmemtrav;  /* memory traversed in this step */
     }
     case GCSatomic: {
       lu_mem work;
+      l_mem start = luai_gcclock();
       propagateall(g);  /* make sure gray list is empty */
       work = atomic(L);  /* work is what was traversed by 'atomic' */
       entersweep(L);
       g->GCestimate = gettotalbytes(g);  /* first estimate */;
+      g->gcatomictime = luai_gcclock() - start;
+      g->gcatomicwork = work;
+      g->gcatomicremarks = g->gcremarks;
       return work;
     }
     case GCSswpallgc: {  /* sweep "regular" objects */
+#if defined(LUAI_GCPAGES)
+      if (g->sweeppage != NULL)  /* first sweep pages */
+        return sweeppages(L, g);
+#endif
       return sweepstep(L, g, GCSswpfinobj, &g->finobj);
     }
     case GCSswpfinobj: {  /* sweep objects with finalizers */
@@ -1122,6 +1774,79 @@ static l_mem getdebt (global_State *g) {
   }
 }
 
+/*
+** {======================================================
+** Timed pacer
+** With 'gcmaxpause' > 0, each step runs until it reaches that duration
+** (or is predicted to overrun it, given the measured GC speed). The
+** cycle starts when the heap reaches half the targeted growth over the
+** live data ('GCestimate'); after each step, the mutator may allocate a
+** share of the other half proportional to the share of the expected
+** cycle work (the work of the last cycle) done by that step.
+** =======================================================
+*/
+
+/* duration class (in the step histogram) of 't' microseconds */
+static int stepclass (l_mem t) {
+  int c = (t <= 0) ? 0 : luaO_ceillog2(cast(unsigned int,
+                                  (t < MAX_INT) ? t + 1 : MAX_INT));
+  return (c < GCNSTEPHIST) ? c : GCNSTEPHIST - 1;
+}
+
+
+/*
+** Allocation allowed after a step that did 'work' units of work
+*/
+static l_mem stepcredit (global_State *g, lu_mem work) {
+  l_mem estimate = g->GCestimate / PAUSEADJ;  /* adjust 'estimate' */
+  int half = (g->gcgrowth - PAUSEADJ) / 2;
+  lu_mem expected = (g->gclastwork > g->GCestimate) ? g->gclastwork
+                                                    : g->GCestimate;
+  l_mem allowance, ratio, units, credit;
+  lua_assert(estimate > 0);
+  allowance = (half < MAX_LMEM / estimate) ? estimate * half : MAX_LMEM;
+  ratio = allowance / cast(l_mem, expected / 64 + 1);  /* (times 64) */
+  units = cast(l_mem, work / 64) + 1;
+  credit = (ratio < MAX_LMEM / units) ? units * ratio : MAX_LMEM;
+  return (credit > GCSTEPSIZE) ? credit : GCSTEPSIZE;
+}
+
+
+/*
+** performs a GC step limited by time
+*/
+static void timedstep (lua_State *L) {
+  global_State *g = G(L);
+  l_mem start = luai_gcclock();
+  l_mem elapsed;
+  lu_mem work = 0;
+  lu_mem last;  /* work done by last single step */
+  do {
+    last = singlestep(L);
+    work += last;
+    elapsed = luai_gcclock() - start;
+  } while (g->gcstate != GCSpause &&  /* stop at the end of a cycle */
+           elapsed + cast(l_mem, last) / g->gcrate < g->gcmaxpause);
+  g->gcsteptime[stepclass(elapsed)]++;
+  if (elapsed > 0) {  /* update measured speed */
+    g->gcrate = (g->gcrate * 3 + cast(l_mem, work) / elapsed) / 4;
+    if (g->gcrate < 1) g->gcrate = 1;
+  }
+  g->gccyclework += work;
+  if (g->gcstate == GCSpause) {
+    g->gclastwork = g->gccyclework;
+    g->gccyclework = 0;
+    setpause(g);  /* pause until next cycle */
+  }
+  else {
+    luaE_setdebt(g, g->GCdebt - stepcredit(g, work));
+    runafewfinalizers(L);
+  }
+}
+
+/* }====================================================== */
+
+
 /*
 ** performs a basic GC step when collector is running
 */
@@ -1132,6 +1857,12 @@ void luaC_step (lua_State *L) {
     luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
     return;
   }
+  if (isstrtresizing(&g->strt))  /* string table being resized? */
+    luaS_resizestep(L, STRTABSTEP);  /* help it */
+  if (g->gcmaxpause > 0) {  /* time-budgeted pacer? */
+    timedstep(L);
+    return;
+  }
   do {  /* repeat until pause or enough "credit" (negative debt) */
     lu_mem work = singlestep(L);  /* perform one single step */
     debt -= work;
@@ -1160,6 +1891,9 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   lua_assert(g->gckind == KGC_NORMAL);
   if (isemergency) g->gckind = KGC_EMERGENCY;  /* set flag */
   if (keepinvariant(g)) {  /* black objects? */
+#if defined(LUAI_GCPAGES)
+    markallpages(g);  /* white objects in pages are not dead either */
+#endif
     entersweep(L); /* sweep everything to turn them back to white */
   }
   /* finish any pending sweep phase to start a new cycle */
@@ -79,6 +79,7 @@
 #define WHITE1BIT	1  /* object is white (type 1) */
 #define BLACKBIT	2  /* object is black */
 #define FINALIZEDBIT	3  /* object has been marked for finalization */
+#define PAGEDBIT	4  /* object lives in a heap page */
 /* bit 7 is currently used by tests (luaL_checkmemory) */
 
 #define WHITEBITS	bit2mask(WHITE0BIT, WHITE1BIT)
@@ -100,6 +101,105 @@
 
 #define luaC_white(g)	cast(lu_byte, (g)->currentwhite & WHITEBITS)
 
+#define ispaged(x)	testbit((x)->marked, PAGEDBIT)
+
+
+/*
+** {======================================================
+** Paged heap
+** =======================================================
+*/
+
+#if defined(LUAI_GCPAGES)
+
+/*
+** With 'LUAI_GCPAGES', small collectable objects do not live in list
+** 'allgc'; they are allocated in pages segregated by size class. Each
+** page keeps side bitmaps telling which slots are in use, which were
+** marked in the current cycle, and which are kept in some other list
+** ('finobj', 'tobefnz', or 'fixedgc'). The sweep of those objects is a
+** scan over the bitmaps of each page. Pages are aligned to their size,
+** so that an object can find its page, and are carved from larger
+** blocks ("chunks") obtained from the allocation function; a page
+** with no live objects is returned to its chunk, and a chunk with no
+** pages in use is returned to the allocation function.
+*/
+
+#define GCPAGESIZE	(cast(size_t, 1) << GCPAGEBITS)
+
+/* number of bits in each word of a page bitmap */
+#define GCWORDBITS	cast_int(sizeof(unsigned int) * CHAR_BIT)
+
+/* number of words in each page bitmap (one bit per grain) */
+#define GCPAGEWORDS	((GCPAGESIZE >> GCGRAINBITS) / GCWORDBITS)
+
+
+typedef struct GCPage {
+  struct GCPage *next;  /* next page in list 'pages' */
+  struct GCPage *nextfree;  /* next page of same class with free slots */
+  struct GCPage *prevfree;  /* previous page of same class with free slots */
+  struct GCChunk *chunk;  /* chunk where page lives */
+  void *freeslot;  /* list of free slots (linked through their first word) */
+  unsigned short objsize;  /* size of each slot */
+  unsigned short nslots;  /* number of slots in the page */
+  unsigned short nused;  /* number of slots in use */
+  lu_byte sweepmark;  /* equal to 'g->pagesweepmark' if page already swept */
+  unsigned int alloc[GCPAGEWORDS];  /* slots in use */
+  unsigned int mark[GCPAGEWORDS];  /* slots marked in current cycle */
+  unsigned int keep[GCPAGEWORDS];  /* slots also kept in some other list */
+} GCPage;
+
+
+typedef struct GCChunk {
+  struct GCChunk *next;  /* list of chunks with free pages */
+  struct GCChunk *prev;
+  void *block;  /* block allocated for the chunk */
+  GCPage *freepage;  /* list of free pages (linked through 'next') */
+  int nfree;  /* number of free pages */
+} GCChunk;
+
+
+/* offset of first slot in a page */
+#define GCPAGEHEADER \
+	((sizeof(GCPage) + GCPAGEGRAIN - 1) & ~cast(size_t, GCPAGEGRAIN - 1))
+
+/* page containing a paged object */
+#define gcpageof(o)  \
+	cast(GCPage *, cast(char *, (o)) - \
+	               (cast(size_t, (o)) & (GCPAGESIZE - 1)))
+
+/* bit of an object in the bitmaps of its page */
+#define gcslotbit(p,o)	\
+	cast_int((cast(char *, (o)) - cast(char *, (p))) >> GCGRAINBITS)
+
+/* object corresponding to a bit in the bitmaps of a page */
+#define gcbitslot(p,b)	\
+	cast(GCObject *, cast(char *, (p)) + (cast(size_t, (b)) << GCGRAINBITS))
+
+#define gcsetpagebit(m,b)	((m)[(b) / GCWORDBITS] |= 1u << ((b) % GCWORDBITS))
+#define gcclrpagebit(m,b)	((m)[(b) / GCWORDBITS] &= ~(1u << ((b) % GCWORDBITS)))
+#define gctstpagebit(m,b)	((m)[(b) / GCWORDBITS] & (1u << ((b) % GCWORDBITS)))
+
+/* true if page has not been swept in current sweep phase */
+#define gcpendingpage(g,p)	((p)->sweepmark != (g)->pagesweepmark)
+
+/* set the mark bit of an object (if it is paged) */
+#define luaC_markpaged(o)  \
+	(ispaged(o) ? \
+	 cast_void(gcsetpagebit(gcpageof(o)->mark, gcslotbit(gcpageof(o), o))) : \
+	 cast_void(0))
+
+LUAI_FUNC void luaC_freegco (lua_State *L, GCObject *o, size_t sz);
+
+#else
+
+#define luaC_markpaged(o)	((void)0)
+#define luaC_freegco(L,o,sz)	luaM_freemem(L, o, sz)
+
+#endif
+
+/* }====================================================== */
+
 
 /*
 ** Does one step of collection when debt becomes positive. 'pre'/'pos'
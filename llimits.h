@@ -200,6 +200,41 @@ typedef unsigned long Instruction;
 #endif
 
 
+/*
+** Parameters for the paged heap (see 'LUAI_GCPAGES' in lgc.h): log2 of
+** the size of a page, number of pages allocated together in a chunk,
+** and largest object allocated in pages (must be a multiple of
+** 'GCPAGEGRAIN').
+*/
+#if !defined(GCPAGEBITS)
+#define GCPAGEBITS	13
+#endif
+
+#if !defined(GCCHUNKPAGES)
+#define GCCHUNKPAGES	16
+#endif
+
+#if !defined(GCPAGEMAXOBJ)
+#define GCPAGEMAXOBJ	256
+#endif
+
+/* granularity of size classes (log2) */
+#define GCGRAINBITS	4
+#define GCPAGEGRAIN	(1 << GCGRAINBITS)
+
+#define GCNUMCLASSES	(GCPAGEMAXOBJ / GCPAGEGRAIN)
+
+
+/*
+** number of classes in the histogram of GC step durations; class 'i'
+** counts steps that took from 2^(i-1) up to 2^i microseconds (the last
+** class counts all longer steps)
+*/
+#if !defined(GCNSTEPHIST)
+#define GCNSTEPHIST	16
+#endif
+
+
 /* minimum size for string buffer */
 #if !defined(LUA_MINBUFFER)
 #define LUA_MINBUFFER	32
@@ -10,6 +10,7 @@
 #include "lprefix.h"
 
 
+#include <float.h>
 #include <locale.h>
 #include <math.h>
 #include <stdarg.h>
@@ -243,6 +244,84 @@ static lua_Number lua_strx2number (const char *s, char **endptr) {
 /* }====================================================== */
 
 
+#if LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE	/* { */
+
+/* powers of 10 that are exact as doubles */
+static const double exactpow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+  1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define MAXEXACTPOW10	22
+
+/* maximum number of significant digits in 'l_str2dfast' */
+#define MAXFASTDIG	15
+
+
+/*
+** Fast path for decimal numerals: when the significant digits fit in
+** a double and the power of 10 is exact, one multiplication (or
+** division) gives the correctly rounded result. Returns NULL in all
+** other cases (including invalid numerals), which are left to
+** 'lua_str2number'.
+*/
+static const char *l_str2dfast (const char *s, lua_Number *result) {
+  double m = 0;  /* significant digits */
+  int sigdig = 0;  /* number of significant digits */
+  int e = 0;  /* decimal exponent */
+  int nodigits = 1;
+  int neg;
+  while (lisspace(cast_uchar(*s))) s++;  /* skip initial spaces */
+  neg = isneg(&s);
+  for (; lisdigit(cast_uchar(*s)); s++) {
+    nodigits = 0;
+    if (sigdig == 0 && *s == '0') continue;  /* leading zero */
+    if (++sigdig > MAXFASTDIG) return NULL;
+    m = m * 10 + (*s - '0');
+  }
+  if (*s == '.') {
+    for (s++; lisdigit(cast_uchar(*s)); s++) {
+      nodigits = 0;
+      e--;
+      if (sigdig == 0 && *s == '0') continue;  /* leading zero */
+      if (++sigdig > MAXFASTDIG) return NULL;
+      m = m * 10 + (*s - '0');
+    }
+  }
+  if (nodigits) return NULL;
+  if (*s == 'e' || *s == 'E') {  /* exponent part? */
+    int exp1 = 0;
+    int neg1;
+    s++;  /* skip 'e' */
+    neg1 = isneg(&s);
+    if (!lisdigit(cast_uchar(*s))) return NULL;
+    for (; lisdigit(cast_uchar(*s)); s++) {
+      if (exp1 > 2 * MAXEXACTPOW10 + MAXFASTDIG) return NULL;  /* too big */
+      exp1 = exp1 * 10 + (*s - '0');
+    }
+    e += (neg1) ? -exp1 : exp1;
+  }
+  while (lisspace(cast_uchar(*s))) s++;  /* skip trailing spaces */
+  if (*s != '\0') return NULL;
+  if (m != 0) {
+    if (e > MAXEXACTPOW10 && e - MAXEXACTPOW10 <= MAXFASTDIG - sigdig) {
+      m *= exactpow10[e - MAXEXACTPOW10];  /* still exact */
+      e = MAXEXACTPOW10;
+    }
+    if (e < -MAXEXACTPOW10 || e > MAXEXACTPOW10) return NULL;
+    m = (e >= 0) ? m * exactpow10[e] : m / exactpow10[-e];
+  }
+  *result = (neg) ? -m : m;
+  return s;
+}
+
+#else					/* }{ */
+
+#define l_str2dfast(s,result)	NULL
+
+#endif					/* } */
+
+
 /* maximum length of a numeral */
 #if !defined (L_MAXLENNUM)
 #define L_MAXLENNUM	200
@@ -272,9 +351,13 @@ static const char *l_str2dloc (const char *s, lua_Number *result, int mode) {
 ** current locale radix mark, and tries to convert again.
 */
 static const char *l_str2d (const char *s, lua_Number *result) {
-  const char *endptr;
-  const char *pmode = strpbrk(s, ".xXnN");
-  int mode = pmode ? ltolower(cast_uchar(*pmode)) : 0;
+  const char *endptr = l_str2dfast(s, result);
+  const char *pmode;
+  int mode;
+  if (endptr != NULL)  /* common case? */
+    return endptr;
+  pmode = strpbrk(s, ".xXnN");
+  mode = pmode ? ltolower(cast_uchar(*pmode)) : 0;
   if (mode == 'n')  /* reject 'inf' and 'nan' */
     return NULL;
   endptr = l_str2dloc(s, result, mode);  /* try to convert */
@@ -361,10 +444,175 @@ int luaO_utf8esc (char *buff, unsigned long x) {
 }
 
 
+/*
+** {======================================================
+** Conversion of numbers to strings
+** =======================================================
+*/
+
 /* maximum length of the conversion of a number to a string */
 #define MAXNUMBER2STR	50
 
 
+/* pairs of decimal digits, from "00" to "99" */
+static const char digitpairs[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233"
+  "34353637383940414243444546474849505152535455565758596061626364656667"
+  "6869707172737475767778798081828384858687888990919293949596979899";
+
+
+/* converts an integer to a string (as LUA_INTEGER_FMT), without 'sprintf' */
+static int tostringint (char *buff, lua_Integer i) {
+  char temp[MAXNUMBER2STR];
+  char *p = temp + sizeof(temp);
+  lua_Unsigned u = l_castS2U(i);
+  int len;
+  if (i < 0) u = 0u - u;  /* absolute value (also for MININTEGER) */
+  while (u >= 100) {  /* two digits at a time */
+    const char *d = digitpairs + (u % 100) * 2;
+    u /= 100;
+    *--p = d[1]; *--p = d[0];
+  }
+  if (u >= 10) {
+    *--p = digitpairs[u * 2 + 1]; *--p = digitpairs[u * 2];
+  }
+  else
+    *--p = cast(char, '0' + u);
+  if (i < 0) *--p = '-';
+  len = cast_int(temp + sizeof(temp) - p);
+  memcpy(buff, p, len);
+  return len;
+}
+
+
+#if LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE	/* { */
+
+/* maximum precision handled by 'fmtg' */
+#define MAXFASTPREC	15
+
+
+/* 'x' times 10^s, with at most one rounding */
+#define scale10(x,s)  \
+	((s) >= 0 ? (x) * exactpow10[s] : (x) / exactpow10[-(s)])
+
+
+/*
+** Formats positive 'x' as '%.<prec>g' would. 'x' is scaled by an exact
+** power of 10 to have 'prec' digits before the point, which costs at
+** most one rounding; so, its rounding to an integer gives the exact
+** digits, unless the fraction is too close to one half. In that case,
+** or when there is no exact power of 10 to scale 'x', returns 0.
+*/
+static int fmtg (char *buff, double x, int prec) {
+  char digits[MAXFASTPREC];
+  double y, fl;
+  unsigned long d;
+  int be, e, s, nd, i;
+  int len = 0;
+  cast_void(frexp(x, &be));
+  e = cast_int(floor((be - 1) * 0.30102999566398120));  /* may be 1 less */
+  s = prec - 1 - e;
+  if (s < -MAXEXACTPOW10 || s > MAXEXACTPOW10) return 0;
+  y = scale10(x, s);
+  if (y >= exactpow10[prec]) {  /* 'e' was 1 less than the exponent? */
+    e++; s--;
+    if (s < -MAXEXACTPOW10) return 0;
+    y = scale10(x, s);
+  }
+  fl = floor(y);
+  if (fabs((y - fl) - 0.5) <= y * DBL_EPSILON)  /* maybe a tie? */
+    return 0;
+  if (y - fl > 0.5) fl += 1;  /* round to nearest */
+  if (fl >= exactpow10[prec]) {  /* rounding added a digit? */
+    fl = exactpow10[prec - 1]; e++;
+  }
+  d = (unsigned long)(fl - floor(fl / 1e8) * 1e8);  /* lower 8 digits */
+  for (i = prec - 1; i >= 0; i--) {
+    if (i == prec - 9)  /* lower 8 digits done? */
+      d = (unsigned long)floor(fl / 1e8);  /* go to the others */
+    digits[i] = cast(char, '0' + d % 10);
+    d /= 10;
+  }
+  for (nd = prec; nd > 1 && digits[nd - 1] == '0'; nd--) ;  /* trim zeros */
+  if (e < -4 || e >= prec) {  /* exponential notation? */
+    buff[len++] = digits[0];
+    if (nd > 1) {
+      buff[len++] = lua_getlocaledecpoint();
+      memcpy(buff + len, digits + 1, nd - 1);
+      len += nd - 1;
+    }
+    buff[len++] = 'e';
+    buff[len++] = (e < 0) ? '-' : '+';
+    if (e < 0) e = -e;
+    if (e >= 100) buff[len++] = cast(char, '0' + e / 100);
+    buff[len++] = cast(char, '0' + e / 10 % 10);
+    buff[len++] = cast(char, '0' + e % 10);
+  }
+  else if (e >= 0) {  /* 'e + 1' digits before the point */
+    for (i = 0; i <= e; i++)
+      buff[len++] = (i < nd) ? digits[i] : '0';
+    if (nd > e + 1) {
+      buff[len++] = lua_getlocaledecpoint();
+      memcpy(buff + len, digits + e + 1, nd - e - 1);
+      len += nd - e - 1;
+    }
+  }
+  else {  /* '0.' followed by '-e - 1' zeros before the digits */
+    buff[len++] = '0';
+    buff[len++] = lua_getlocaledecpoint();
+    for (i = -1; i > e; i--)
+      buff[len++] = '0';
+    memcpy(buff + len, digits, nd);
+    len += nd;
+  }
+  return len;
+}
+
+#endif					/* } */
+
+
+/*
+** Converts a float to a string with the given precision (as a '%g'
+** format). Tries 'fmtg' for finite non-zero doubles; otherwise, uses
+** 'lua_number2str' (for the default precision) or 'snprintf'.
+*/
+static int fmtflt (char *buff, lua_Number n, int prec) {
+#if LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE
+  if (prec <= MAXFASTPREC && n != 0 && n - n == 0) {  /* finite? */
+    int neg = (n < 0);
+    int len = fmtg(buff + neg, neg ? -n : n, prec);
+    if (len > 0) {
+      if (neg) buff[0] = '-';
+      return len + neg;
+    }
+  }
+#endif
+  if (prec == LUAI_NUMPREC)
+    return lua_number2str(buff, MAXNUMBER2STR, n);
+  else {
+    char form[MAXNUMBER2STR];  /* '%.<prec>g' */
+    l_sprintf(form, sizeof(form), "%%.%d" LUA_NUMBER_FRMLEN "g", prec);
+    return l_sprintf(buff, MAXNUMBER2STR, form, (LUAI_UACNUMBER)n);
+  }
+}
+
+
+static int tostringflt (char *buff, lua_Number n) {
+  int len = fmtflt(buff, n, LUAI_NUMPREC);
+  buff[len] = '\0';
+#if defined(LUA_FLOATROUNDTRIP)
+  { int prec = LUAI_NUMPREC;
+    while (!luai_numisnan(n) && lua_str2number(buff, NULL) != n &&
+           prec < l_mathlim(DIG) + 3) {  /* does not read back? */
+      len = fmtflt(buff, n, ++prec);  /* try one more digit */
+      buff[len] = '\0';
+    }
+  }
+#endif
+  return len;
+}
+
+
 /*
 ** Convert a number object to a string
 */
@@ -373,9 +621,9 @@ void luaO_tostring (lua_State *L, StkId obj) {
   size_t len;
   lua_assert(ttisnumber(obj));
   if (ttisinteger(obj))
-    len = lua_integer2str(buff, sizeof(buff), ivalue(obj));
+    len = tostringint(buff, ivalue(obj));
   else {
-    len = lua_number2str(buff, sizeof(buff), fltvalue(obj));
+    len = tostringflt(buff, fltvalue(obj));
 #if !defined(LUA_COMPAT_FLOATSTRING)
     if (buff[strspn(buff, "-0123456789")] == '\0') {  /* looks like an int? */
       buff[len++] = lua_getlocaledecpoint();
@@ -386,6 +634,8 @@ void luaO_tostring (lua_State *L, StkId obj) {
   setsvalue2s(L, obj, luaS_newlstr(L, buff, len));
 }
 
+/* }====================================================== */
+
 
 static void pushstr (lua_State *L, const char *str, size_t l) {
   setsvalue2s(L, L->top, luaS_newlstr(L, str, l));
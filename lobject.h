@@ -303,7 +303,7 @@ typedef TValue *StkId;  /* index to stack elements */
 typedef struct TString {
   CommonHeader;
   lu_byte extra;  /* reserved words for short strings; "has hash" for longs */
-  lu_byte shrlen;  /* length for short strings */
+  lu_byte shrlen;  /* length for short strings; kind for long references */
   unsigned int hash;
   union {
     size_t lnglen;  /* length for long strings */
@@ -321,12 +321,62 @@ typedef union UTString {
 } UTString;
 
 
+/*
+** A long string may keep its contents outside its object (a "reference
+** string"); such strings have 'shrlen' equal to 'LSTRREF' or 'LSTRBUF'
+** (values no short string can have) and a 'LStrRef' after the header.
+** A string with a 'parent' is a view of part of the parent's contents
+** (which it keeps alive); unlike other strings, a view may be not
+** followed by a '\0'. A reference string without a parent owns its
+** contents, a block with 'size' bytes. 'LSTRBUF' marks the (internal)
+** append buffers used by concatenation and 'LSTROPEN' marks strings
+** still being built by the API (see 'lstring.c'). 'LSTREXT' marks
+** external strings, whose contents belong to the host; they have a
+** 'LStrExt' after their 'LStrRef'. A plain long string made by a
+** concatenation has 'shrlen' equal to 'LSTRCAT' until it is extended
+** by another concatenation (see 'luaS_extend').
+*/
+#define LSTRREF		255
+#define LSTRBUF		254
+#define LSTROPEN	253
+#define LSTREXT		252
+#define LSTRCAT		1
+
+typedef struct LStrRef {
+  char *contents;
+  struct TString *parent;  /* string that owns 'contents' (or NULL) */
+  size_t size;  /* size of block owned by the string */
+} LStrRef;
+
+typedef struct LStrExt {
+  lua_Alloc falloc;  /* function to release the contents (or NULL) */
+  void *ud;  /* auxiliary data to 'falloc' */
+} LStrExt;
+
+#define isstrref(ts)	((ts)->shrlen >= LSTREXT)
+#define isstrbuf(ts)	((ts)->shrlen == LSTRBUF)
+#define isstropen(ts)	((ts)->shrlen == LSTROPEN)
+#define isstrext(ts)	((ts)->shrlen == LSTREXT)
+#define isstrcat(ts)	((ts)->shrlen == LSTRCAT)
+
+#define getstrref(ts)  \
+  check_exp(isstrref(ts), \
+            cast(LStrRef *, cast(char *, (ts)) + sizeof(UTString)))
+
+#define getstrext(ts)  \
+  check_exp(isstrext(ts), cast(LStrExt *, getstrref(ts) + 1))
+
+#define isstrview(ts)	(isstrref(ts) && getstrref(ts)->parent != NULL)
+
+
 /*
 ** Get the actual string (array of bytes) from a 'TString'.
 ** (Access to 'extra' ensures that value is really a 'TString'.)
 */
 #define getstr(ts)  \
-  check_exp(sizeof((ts)->extra), cast(char *, (ts)) + sizeof(UTString))
+  check_exp(sizeof((ts)->extra), \
+    isstrref(ts) ? getstrref(ts)->contents \
+                 : cast(char *, (ts)) + sizeof(UTString))
 
 
 /* get the actual string (array of bytes) from a Lua value */
@@ -494,14 +544,27 @@ typedef struct Node {
 } Node;
 
 
+/*
+** Old hash part of a table being rehashed incrementally (see 'ltable.c')
+*/
+typedef struct OldNodes {
+  Node *node;
+  int size;  /* number of nodes (0 if 'node' is not allocated) */
+  int cursor;  /* nodes below it were already moved to the new part */
+  int step;  /* number of nodes to move at each insertion */
+} OldNodes;
+
+
 typedef struct Table {
   CommonHeader;
   lu_byte flags;  /* 1<<p means tagmethod(p) is not present */
   lu_byte lsizenode;  /* log2 of size of 'node' array */
   unsigned int sizearray;  /* size of 'array' array */
+  unsigned int lenhint;  /* last border found by 'luaH_getn' */
   TValue *array;  /* array part */
   Node *node;
   Node *lastfree;  /* any free position is before this position */
+  OldNodes *old;  /* old hash part during an incremental rehash */
   struct Table *metatable;
   GCObject *gclist;
 } Table;
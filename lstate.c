@@ -36,6 +36,10 @@
 #define LUAI_GCMUL	200 /* GC runs 'twice the speed' of memory allocation */
 #endif
 
+#if !defined(LUAI_GCGROWTH)
+#define LUAI_GCGROWTH	200  /* timed pacer keeps heap below 200% of live data */
+#endif
+
 
 /*
 ** a macro to help the creation of a unique random seed when a state is
@@ -245,7 +249,7 @@ static void close_state (lua_State *L) {
   luaC_freeallobjects(L);  /* collect all objects */
   if (g->version)  /* closing a fully built state? */
     luai_userstateclose(L);
-  luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
+  luaM_freearray(L, G(L)->strt.hash, strtallocsize(&G(L)->strt));
   freestack(L);
   lua_assert(gettotalbytes(g) == sizeof(LG));
   (*g->frealloc)(g->ud, fromstate(L), sizeof(LG), 0);  /* free main block */
@@ -311,7 +315,7 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->seed = makeseed(L);
   g->gcrunning = 0;  /* no GC while building state */
   g->GCestimate = 0;
-  g->strt.size = g->strt.nuse = 0;
+  g->strt.size = g->strt.nuse = g->strt.oldsize = g->strt.moved = 0;
   g->strt.hash = NULL;
   setnilvalue(&g->l_registry);
   g->panic = NULL;
@@ -323,12 +327,31 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gray = g->grayagain = NULL;
   g->weak = g->ephemeron = g->allweak = NULL;
   g->twups = NULL;
+#if defined(LUAI_GCPAGES)
+  g->pages = NULL;
+  g->sweeppage = NULL;
+  for (i=0; i < GCNUMCLASSES; i++) g->freepages[i] = NULL;
+  g->chunks = NULL;
+  g->pagesweepmark = 0;
+#endif
   g->totalbytes = sizeof(LG);
   g->GCdebt = 0;
   g->gcfinnum = 0;
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
+  g->gcmaxpause = 0;  /* work-based pacer */
+  g->gcgrowth = LUAI_GCGROWTH;
+  g->gcrate = 1;  /* (pessimistic) until measured */
+  g->gccyclework = g->gclastwork = 0;
+  for (i=0; i < GCNSTEPHIST; i++) g->gcsteptime[i] = 0;
+  g->gcnmarked = 0;
+  g->gcremarks = 0;
+  g->gcatomictime = 0;
+  g->gcatomicwork = 0;
+  g->gcatomicremarks = 0;
+  g->ephmap = NULL;
   for (i=0; i < LUA_NUMTAGS; i++) g->mt[i] = NULL;
+  for (i=0; i <= UCHAR_MAX; i++) g->charstr[i] = NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
     close_state(L);
@@ -26,6 +26,10 @@
 ** 'tobefnz': all objects ready to be finalized;
 ** 'fixedgc': all objects that are not to be collected (currently
 ** only small strings, such as reserved words).
+**
+** With a paged heap ('LUAI_GCPAGES'), objects that live in a page are
+** not linked in 'allgc'; they belong to their pages instead (but they
+** still go to the other lists when needed).
 
 */
 
@@ -55,10 +59,17 @@ struct lua_longjmp;  /* defined in ldo.c */
 #define KGC_EMERGENCY	1	/* gc was forced by an allocation failure */
 
 
+/*
+** The string table is resized incrementally (see 'lstring.c'): while
+** 'oldsize' is different from 'size', the buckets below 'moved' are
+** already organized for the new size.
+*/
 typedef struct stringtable {
   TString **hash;
   int nuse;  /* number of elements */
   int size;
+  int oldsize;  /* size before the resize in progress (or 'size') */
+  int moved;  /* number of buckets already moved to the new size */
 } stringtable;
 
 
@@ -141,9 +152,28 @@ typedef struct global_State {
   GCObject *tobefnz;  /* list of userdata to be GC */
   GCObject *fixedgc;  /* list of objects not to be collected */
   struct lua_State *twups;  /* list of threads with open upvalues */
+#if defined(LUAI_GCPAGES)
+  struct GCPage *pages;  /* list of all heap pages */
+  struct GCPage **sweeppage;  /* current position of sweep in 'pages' */
+  struct GCPage *freepages[GCNUMCLASSES];  /* pages with free slots */
+  struct GCChunk *chunks;  /* list of chunks with free pages */
+  lu_byte pagesweepmark;  /* flips at each sweep (see 'gcpendingpage') */
+#endif
   unsigned int gcfinnum;  /* number of finalizers to call in each GC step */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC 'granularity' */
+  int gcmaxpause;  /* max. duration of a step (microseconds; 0 = no limit) */
+  int gcgrowth;  /* heap growth targeted by the timed pacer */
+  l_mem gcrate;  /* measured GC work per microsecond */
+  lu_mem gccyclework;  /* work done so far in current cycle */
+  lu_mem gclastwork;  /* work done in last complete cycle */
+  lu_mem gcsteptime[GCNSTEPHIST];  /* histogram of step durations */
+  lu_mem gcnmarked;  /* number of objects marked in current remark pass */
+  lu_byte gcremarks;  /* number of remark passes in current cycle */
+  l_mem gcatomictime;  /* duration of last atomic phase (microseconds) */
+  lu_mem gcatomicwork;  /* work done by last atomic phase */
+  lu_byte gcatomicremarks;  /* remark passes before last atomic phase */
+  struct EphMap *ephmap;  /* pending ephemeron entries (see 'lgc.c') */
   lua_CFunction panic;  /* to be called in unprotected errors */
   struct lua_State *mainthread;
   const lua_Number *version;  /* pointer to version number */
@@ -151,6 +181,7 @@ typedef struct global_State {
   TString *tmname[TM_N];  /* array with tag-method names */
   struct Table *mt[LUA_NUMTAGS];  /* metatables for basic types */
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
+  TString *charstr[UCHAR_MAX + 1];  /* single-character strings (or NULL) */
 } global_State;
 
 
@@ -26,8 +26,8 @@
 
 
 /*
-** Lua will use at most ~(2^LUAI_HASHLIMIT) bytes from a string to
-** compute its hash
+** Lua will use at most ~(2^LUAI_HASHLIMIT) bytes from a short string to
+** compute its hash (long strings use all their bytes; see 'hashlong')
 */
 #if !defined(LUAI_HASHLIMIT)
 #define LUAI_HASHLIMIT		5
@@ -55,10 +55,48 @@ unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
 }
 
 
+/*
+** Hash for long strings. Unlike 'luaS_hash', it uses all bytes of the
+** string, so that long keys sharing most of their contents (e.g., paths
+** or URLs) do not collide. It reads the string one word ('unsigned
+** int') at a time into two independent lanes, so that consecutive words
+** are mixed in parallel; each word is scrambled by multiplications and
+** a rotation (as in MurmurHash3). The few remaining bytes go to the
+** first lane, and both lanes are combined by a final avalanche.
+*/
+#define HWORD		sizeof(unsigned int)
+
+#define rotl(x,n)	(((x) << (n)) | ((x) >> (HWORD * CHAR_BIT - (n))))
+
+#define hashmix(h,w)  \
+	{ unsigned int k_ = (w) * 0xcc9e2d51u; k_ = rotl(k_, 15) * 0x1b873593u; \
+	  h ^= k_; h = rotl(h, 13) * 5 + 0xe6546b64u; }
+
+static unsigned int hashlong (const char *str, size_t l, unsigned int seed) {
+  unsigned int h1 = seed ^ cast(unsigned int, l);
+  unsigned int h2 = seed + 0x9e3779b9u;
+  size_t i;
+  for (i = 0; i + 2 * HWORD <= l; i += 2 * HWORD) {
+    unsigned int w1, w2;
+    memcpy(&w1, str + i, HWORD);  /* (string may not be aligned) */
+    memcpy(&w2, str + i + HWORD, HWORD);
+    hashmix(h1, w1);
+    hashmix(h2, w2);
+  }
+  for (; i < l; i++)  /* remaining bytes */
+    h1 ^= ((h1<<5) + (h1>>2) + cast_byte(str[i]));
+  h1 ^= rotl(h2, 16);
+  h1 ^= h1 >> 16; h1 *= 0x85ebca6bu;  /* final avalanche */
+  h1 ^= h1 >> 13; h1 *= 0xc2b2ae35u;
+  h1 ^= h1 >> 16;
+  return h1;
+}
+
+
 unsigned int luaS_hashlongstr (TString *ts) {
   lua_assert(ts->tt == LUA_TLNGSTR);
   if (ts->extra == 0) {  /* no hash? */
-    ts->hash = luaS_hash(getstr(ts), ts->u.lnglen, ts->hash);
+    ts->hash = hashlong(getstr(ts), ts->u.lnglen, ts->hash);
     ts->extra = 1;  /* now it has its hash */
   }
   return ts->hash;
@@ -66,11 +104,98 @@ unsigned int luaS_hashlongstr (TString *ts) {
 
 
 /*
-** resizes the string table
+** {======================================================
+** String-table resizing
+** Doubling or halving the size of the string table is done in small
+** steps, a few buckets at a time, both arrays sharing a single block
+** (large enough for the largest size). When growing, each bucket 'i'
+** below the old size is split into buckets 'i' and 'i + oldsize';
+** when shrinking, each bucket 'i' below the new size absorbs bucket
+** 'i + size'. Buckets below 'moved' are already done.
+** =======================================================
+*/
+
+/*
+** bucket for hash 'h' (considering a resize in progress)
+*/
+static TString **strbucket (stringtable *tb, unsigned int h) {
+  int i;
+  if (!isstrtresizing(tb))
+    i = lmod(h, tb->size);
+  else if (tb->size > tb->oldsize) {  /* growing? */
+    i = lmod(h, tb->oldsize);
+    if (i < tb->moved)  /* bucket already split? */
+      i = lmod(h, tb->size);
+  }
+  else {  /* shrinking */
+    i = lmod(h, tb->size);
+    if (i >= tb->moved)  /* pair not merged yet? */
+      i = lmod(h, tb->oldsize);
+  }
+  return &tb->hash[i];
+}
+
+
+/*
+** move up to 'n' buckets of a resize in progress to the new size
+*/
+void luaS_resizestep (lua_State *L, int n) {
+  stringtable *tb = &G(L)->strt;
+  if (tb->size > tb->oldsize) {  /* growing? */
+    for (; n > 0 && tb->moved < tb->oldsize; n--, tb->moved++) {
+      TString **p = &tb->hash[tb->moved];
+      TString **q = &tb->hash[tb->moved + tb->oldsize];
+      while (*p != NULL) {  /* split bucket 'moved' */
+        TString *ts = *p;
+        if (lmod(ts->hash, tb->size) != tb->moved) {  /* goes up? */
+          *p = ts->u.hnext;  /* remove it from lower bucket */
+          ts->u.hnext = *q;  /* and insert it in upper one */
+          *q = ts;
+        }
+        else
+          p = &ts->u.hnext;
+      }
+    }
+    if (tb->moved == tb->oldsize)  /* all buckets split? */
+      tb->oldsize = tb->size;  /* resize is done */
+  }
+  else if (tb->size < tb->oldsize) {  /* shrinking? */
+    for (; n > 0 && tb->moved < tb->size; n--, tb->moved++) {
+      TString **p = &tb->hash[tb->moved];
+      TString **q = &tb->hash[tb->moved + tb->size];
+      while (*p != NULL)  /* go to the end of lower bucket */
+        p = &(*p)->u.hnext;
+      *p = *q;  /* append upper bucket to it */
+      *q = NULL;
+    }
+    if (tb->moved == tb->size) {  /* all buckets merged? */
+      luaM_reallocvector(L, tb->hash, tb->oldsize, tb->size, TString *);
+      tb->oldsize = tb->size;  /* resize is done */
+    }
+  }
+}
+
+
+/*
+** resizes the string table; doubling or halving the size is done
+** incrementally
 */
 void luaS_resize (lua_State *L, int newsize) {
   int i;
   stringtable *tb = &G(L)->strt;
+  if (isstrtresizing(tb))  /* previous resize still in progress? */
+    luaS_resizestep(L, MAX_INT);  /* finish it */
+  if (tb->size > 0 && (newsize == tb->size * 2 || newsize * 2 == tb->size)) {
+    if (newsize > tb->size) {  /* grow array now */
+      luaM_reallocvector(L, tb->hash, tb->size, newsize, TString *);
+      for (i = tb->size; i < newsize; i++)
+        tb->hash[i] = NULL;
+    }
+    tb->oldsize = tb->size;
+    tb->size = newsize;
+    tb->moved = 0;
+    return;
+  }
   if (newsize > tb->size) {  /* grow table if needed */
     luaM_reallocvector(L, tb->hash, tb->size, newsize, TString *);
     for (i = tb->size; i < newsize; i++)
@@ -92,9 +217,11 @@ void luaS_resize (lua_State *L, int newsize) {
     lua_assert(tb->hash[newsize] == NULL && tb->hash[tb->size - 1] == NULL);
     luaM_reallocvector(L, tb->hash, tb->size, newsize, TString *);
   }
-  tb->size = newsize;
+  tb->size = tb->oldsize = newsize;
 }
 
+/* }====================================================== */
+
 
 /*
 ** Clear API string cache. (Entries cannot be empty, so fill them with
@@ -139,6 +266,7 @@ static TString *createstrobj (lua_State *L, size_t l, int tag, unsigned int h) {
   ts = gco2ts(o);
   ts->hash = h;
   ts->extra = 0;
+  ts->shrlen = 0;  /* (not a reference string) */
   getstr(ts)[l] = '\0';  /* ending 0 */
   return ts;
 }
@@ -151,9 +279,252 @@ TString *luaS_createlngstrobj (lua_State *L, size_t l) {
 }
 
 
+/*
+** creates a new reference string with length 'l' (and no contents yet)
+*/
+static TString *newrefstr (lua_State *L, size_t l, size_t totalsize) {
+  GCObject *o = luaC_newobj(L, LUA_TLNGSTR, totalsize);
+  TString *ts = gco2ts(o);
+  ts->hash = G(L)->seed;
+  ts->extra = 0;
+  ts->shrlen = LSTRREF;
+  ts->u.lnglen = l;
+  getstrref(ts)->contents = NULL;
+  getstrref(ts)->parent = NULL;
+  getstrref(ts)->size = 0;
+  return ts;
+}
+
+
+#define createrefstr(L,l)	newrefstr(L, l, sizerefstr)
+
+
+/*
+** Creates a string with the 'l' bytes of string 'ts' starting at 'pos'.
+** Large substrings are created as views, sharing the contents of 'ts'
+** (or of its parent, when 'ts' is a view itself, so that views do not
+** form chains). An open string may still change or move its contents,
+** so substrings of it are always copied. 'ts' must be anchored by the
+** caller.
+*/
+TString *luaS_newsub (lua_State *L, TString *ts, size_t pos, size_t l) {
+  lua_assert(pos <= tsslen(ts) && l <= tsslen(ts) - pos);
+  if (l < LUAI_MINSTRVIEW || isstropen(ts))  /* small or of open string? */
+    return luaS_newlstr(L, getstr(ts) + pos, l);  /* copy it */
+  else if (l == ts->u.lnglen)  /* whole string? */
+    return ts;
+  else {
+    TString *v = createrefstr(L, l);
+    if (isstrview(ts)) {  /* view of a view? */
+      TString *p = getstrref(ts)->parent;
+      pos += cast(size_t, getstr(ts) - getstr(p));
+      ts = p;
+    }
+    getstrref(v)->contents = getstr(ts) + pos;
+    getstrref(v)->parent = ts;
+    return v;
+  }
+}
+
+
+/*
+** Makes a view own a copy of its contents, followed by a '\0' (as all
+** strings given to C code must be).
+*/
+void luaS_detach (lua_State *L, TString *ts) {
+  LStrRef *ref = getstrref(ts);
+  size_t l = ts->u.lnglen;
+  char *buff = luaM_newvector(L, l + 1, char);
+  lua_assert(isstrview(ts));
+  memcpy(buff, ref->contents, l * sizeof(char));
+  buff[l] = '\0';
+  ref->contents = buff;
+  ref->parent = NULL;  /* parent may be collected now */
+  ref->size = l + 1;
+}
+
+
+/*
+** Creates a reference string with length 'l' owning an uninitialized
+** block with 'size' bytes, and pushes it on the stack (to anchor it
+** while allocating the block). The stack must have room for it.
+*/
+static TString *pushownstr (lua_State *L, size_t l, size_t size, int kind) {
+  TString *ts = createrefstr(L, l);
+  ts->shrlen = cast_byte(kind);
+  lua_assert(L->top < L->stack_last + EXTRA_STACK);
+  setsvalue2s(L, L->top, ts);
+  L->top++;
+  getstrref(ts)->contents = luaM_newvector(L, size, char);
+  getstrref(ts)->size = size;
+  return ts;
+}
+
+
+/*
+** Creates an external string, whose contents 's' (followed by a '\0')
+** belong to the host and are released by 'falloc' when the string is
+** collected. Short strings must be internalized, so their contents are
+** copied and released right away. 's' changes hands only after all
+** allocations succeed, so that a memory error leaves it with the host.
+*/
+TString *luaS_newextlstr (lua_State *L, const char *s, size_t l,
+                          lua_Alloc falloc, void *ud) {
+  TString *ts;
+  if (l <= LUAI_MAXSHORTLEN) {
+    ts = luaS_newlstr(L, s, l);
+    if (falloc != NULL)
+      (*falloc)(ud, cast(void *, s), l + 1, 0);
+  }
+  else {
+    ts = newrefstr(L, l, sizeextstr);
+    ts->shrlen = LSTREXT;
+    getstrref(ts)->contents = cast(char *, s);
+    getstrext(ts)->falloc = falloc;
+    getstrext(ts)->ud = ud;
+  }
+  return ts;
+}
+
+
+/*
+** {======================================================
+** Open strings
+** An open string is a long string whose contents are still being
+** written by the C API ('lua_prepstring'). It owns a block with room
+** for 'lnglen' bytes (plus the final '\0'), which may be resized until
+** the string is closed, without copying the contents to another string.
+** =======================================================
+*/
+
+/* creates an open string with room for 'l' bytes and pushes it */
+TString *luaS_pushopen (lua_State *L, size_t l) {
+  if (l >= MAX_SIZE / sizeof(char))
+    luaM_toobig(L);
+  return pushownstr(L, l, l + 1, LSTROPEN);
+}
+
+
+void luaS_resizeopen (lua_State *L, TString *ts, size_t l) {
+  LStrRef *ref = getstrref(ts);
+  lua_assert(isstropen(ts));
+  if (l >= MAX_SIZE / sizeof(char))
+    luaM_toobig(L);
+  luaM_reallocvector(L, ref->contents, ref->size, l + 1, char);
+  ref->size = l + 1;
+  ts->u.lnglen = l;
+}
+
+
+/*
+** Closes open string 'ts' with its first 'l' bytes. Short results must
+** be internalized, so they are copied to a new string.
+*/
+TString *luaS_closeopen (lua_State *L, TString *ts, size_t l) {
+  lua_assert(isstropen(ts) && l <= ts->u.lnglen);
+  if (l <= LUAI_MAXSHORTLEN)
+    return luaS_newlstr(L, getstr(ts), l);
+  if (l < ts->u.lnglen)  /* too much room? */
+    luaS_resizeopen(L, ts, l);  /* shrink block */
+  getstr(ts)[l] = '\0';
+  ts->shrlen = LSTRREF;  /* now a regular string */
+  return ts;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Append buffers
+** A long string built by concatenation can be a view of an "append
+** buffer": an internal reference string owning a block larger than its
+** contents (its length is the part of the block in use). A buffer is
+** only created when the first operand of a concatenation was itself
+** made by a concatenation and was not extended yet, as in the second
+** step of a loop like 's = s .. x'; other long results get exact-size
+** plain strings. When the first operand is a view that ends where the
+** used part of its buffer ends, the other operands are appended there
+** (or to a new, larger buffer, when there is no room) and the result is
+** a new view of the buffer (the old view does not see the new bytes).
+** So, such a loop copies each piece only once, plus the occasional copy
+** to a larger buffer.
+** =======================================================
+*/
+
+/* 'ts' is a view that ends where the used part of its buffer ends */
+#define atbufend(ts)  \
+	(isstrview(ts) && isstrbuf(getstrref(ts)->parent) && \
+	 getstr(ts) + (ts)->u.lnglen == \
+	   getstr(getstrref(ts)->parent) + getstrref(ts)->parent->u.lnglen)
+
+
+/* long string 'ts' is worth extending with an append buffer */
+int luaS_canextend (TString *ts) {
+  return (ts->u.lnglen >= LUAI_MINSTRVIEW && (isstrcat(ts) || atbufend(ts)));
+}
+
+
+/*
+** Returns a string with length 'tl' whose first bytes are the contents
+** of long string 'ts' (which must be anchored and satisfy
+** 'luaS_canextend'); '*p' gets the place where the caller must copy the
+** remaining bytes (before any other allocation).
+*/
+TString *luaS_extend (lua_State *L, TString *ts, size_t tl, char **p) {
+  size_t l = ts->u.lnglen;
+  TString *buf;
+  TString *res;
+  char *start;
+  lua_assert(ts->tt == LUA_TLNGSTR && l < tl && luaS_canextend(ts));
+  buf = isstrview(ts) ? getstrref(ts)->parent : NULL;
+  if (atbufend(ts) &&
+      getstrref(buf)->size - buf->u.lnglen > tl - l) {  /* enough room? */
+    start = getstr(ts);  /* extend 'ts' in place */
+    res = createrefstr(L, tl);
+  }
+  else {  /* create a new buffer with room to grow */
+    size_t size = (tl < MAX_SIZE / 3) ? tl + tl / 2 : tl + 1;
+    buf = pushownstr(L, l, size, LSTRBUF);  /* anchored while allocating */
+    start = getstr(buf);
+    memcpy(start, getstr(ts), l * sizeof(char));
+    res = createrefstr(L, tl);
+    L->top--;
+    if (isstrcat(ts))
+      ts->shrlen = 0;  /* other concatenations with it get exact sizes */
+  }
+  getstrref(res)->contents = start;
+  getstrref(res)->parent = buf;
+  *p = start + l;
+  buf->u.lnglen += tl - l;
+  getstr(buf)[buf->u.lnglen] = '\0';  /* keep buffer ending with a '\0' */
+  return res;
+}
+
+/* }====================================================== */
+
+
+void luaS_freelngstr (lua_State *L, TString *ts) {
+  if (!isstrref(ts))
+    luaC_freegco(L, obj2gco(ts), sizelstring(ts->u.lnglen));
+  else if (isstrext(ts)) {
+    LStrExt *ext = getstrext(ts);
+    if (ext->falloc != NULL)  /* release contents to the host */
+      (*ext->falloc)(ext->ud, getstr(ts), ts->u.lnglen + 1, 0);
+    luaC_freegco(L, obj2gco(ts), sizeextstr);
+  }
+  else {
+    LStrRef *ref = getstrref(ts);
+    if (ref->parent == NULL && ref->contents != NULL)  /* own contents? */
+      luaM_freearray(L, ref->contents, ref->size);
+    luaC_freegco(L, obj2gco(ts), sizerefstr);
+  }
+}
+
+
 void luaS_remove (lua_State *L, TString *ts) {
   stringtable *tb = &G(L)->strt;
-  TString **p = &tb->hash[lmod(ts->hash, tb->size)];
+  TString **p = strbucket(tb, ts->hash);
   while (*p != ts)  /* find previous element */
     p = &(*p)->u.hnext;
   *p = (*p)->u.hnext;  /* remove element from its list */
@@ -168,20 +539,26 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
   TString *ts;
   global_State *g = G(L);
   unsigned int h = luaS_hash(str, l, g->seed);
-  TString **list = &g->strt.hash[lmod(h, g->strt.size)];
+  TString **list = strbucket(&g->strt, h);
   lua_assert(str != NULL);  /* otherwise 'memcmp'/'memcpy' are undefined */
   for (ts = *list; ts != NULL; ts = ts->u.hnext) {
     if (l == ts->shrlen &&
         (memcmp(str, getstr(ts), l * sizeof(char)) == 0)) {
       /* found! */
-      if (isdead(g, ts))  /* dead (but not collected yet)? */
+      if (isdead(g, ts)) {  /* dead (but not collected yet)? */
         changewhite(ts);  /* resurrect it */
+        luaC_markpaged(obj2gco(ts));  /* its page must keep it too */
+      }
       return ts;
     }
   }
-  if (g->strt.nuse >= g->strt.size && g->strt.size <= MAX_INT/2) {
+  if (isstrtresizing(&g->strt)) {  /* resize in progress? */
+    luaS_resizestep(L, STRTABSTEP);  /* do a little of it */
+    list = strbucket(&g->strt, h);  /* recompute bucket */
+  }
+  else if (g->strt.nuse >= g->strt.size && g->strt.size <= MAX_INT/2) {
     luaS_resize(L, g->strt.size * 2);
-    list = &g->strt.hash[lmod(h, g->strt.size)];  /* recompute with new size */
+    list = strbucket(&g->strt, h);  /* recompute with new size */
   }
   ts = createstrobj(L, l, LUA_TSHRSTR, h);
   memcpy(getstr(ts), str, l * sizeof(char));
@@ -193,11 +570,36 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
 }
 
 
+/*
+** Single-character strings are very common (e.g., in code that splits
+** strings into characters), so each one, once created, is fixed (never
+** collected) and kept in 'g->charstr', where later uses find it with
+** no hashing or string-table search. An existing string that was not
+** created here is not cached (as it cannot be fixed), so it may take
+** a few collections for a character to get its fixed string.
+*/
+static TString *charstr (lua_State *L, const char *str) {
+  global_State *g = G(L);
+  TString *ts = g->charstr[cast_byte(*str)];
+  if (ts == NULL) {  /* not cached? */
+    int nuse = g->strt.nuse;
+    ts = internshrstr(L, str, 1);
+    if (g->strt.nuse > nuse) {  /* string was created now? */
+      luaC_fix(L, obj2gco(ts));  /* it will never be collected */
+      g->charstr[cast_byte(*str)] = ts;
+    }
+  }
+  return ts;
+}
+
+
 /*
 ** new string (with explicit length)
 */
 TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
-  if (l <= LUAI_MAXSHORTLEN)  /* short string? */
+  if (l == 1)  /* single character? */
+    return charstr(L, str);
+  else if (l <= LUAI_MAXSHORTLEN)  /* short string? */
     return internshrstr(L, str, l);
   else {
     TString *ts;
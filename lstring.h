@@ -14,6 +14,19 @@
 
 #define sizelstring(l)  (sizeof(union UTString) + ((l) + 1) * sizeof(char))
 
+/* size of the object of a reference string */
+#define sizerefstr	(sizeof(union UTString) + sizeof(LStrRef))
+
+/* size of the object of an external string */
+#define sizeextstr	(sizerefstr + sizeof(LStrExt))
+
+/* memory used by a long string (including contents it owns) */
+#define sizelngstr(ts)  \
+	(!isstrref(ts) ? sizelstring((ts)->u.lnglen) : \
+	 isstrext(ts) ? sizeextstr : \
+	 getstrref(ts)->parent != NULL ? sizerefstr : \
+	 sizerefstr + getstrref(ts)->size)
+
 #define sizeludata(l)	(sizeof(union UUdata) + (l))
 #define sizeudata(u)	sizeludata((u)->len)
 
@@ -21,6 +34,36 @@
                                  (sizeof(s)/sizeof(char))-1))
 
 
+/*
+** minimum length of a substring to be created as a view of its
+** string (see 'luaS_newsub'); must be larger than LUAI_MAXSHORTLEN
+*/
+#if !defined(LUAI_MINSTRVIEW)
+#define LUAI_MINSTRVIEW		64
+#endif
+
+
+/* number of buckets moved by each step of a string-table resize */
+#if !defined(STRTABSTEP)
+#define STRTABSTEP	4
+#endif
+
+/* is the string table being resized? */
+#define isstrtresizing(tb)	((tb)->oldsize != (tb)->size)
+
+/* real size of the array of the string table */
+#define strtallocsize(tb)  \
+	((tb)->size > (tb)->oldsize ? (tb)->size : (tb)->oldsize)
+
+
+/*
+** contents of a string, which must be followed by a '\0' (as needed
+** by C code); views may have to get their own copy of the contents
+*/
+#define luaS_tocstr(L,ts)  \
+	(isstrview(ts) ? luaS_detach(L, ts) : cast_void(0), getstr(ts))
+
+
 /*
 ** test whether a string is a reserved word
 */
@@ -37,6 +80,7 @@ LUAI_FUNC unsigned int luaS_hash (const char *str, size_t l, unsigned int seed);
 LUAI_FUNC unsigned int luaS_hashlongstr (TString *ts);
 LUAI_FUNC int luaS_eqlngstr (TString *a, TString *b);
 LUAI_FUNC void luaS_resize (lua_State *L, int newsize);
+LUAI_FUNC void luaS_resizestep (lua_State *L, int n);
 LUAI_FUNC void luaS_clearcache (global_State *g);
 LUAI_FUNC void luaS_init (lua_State *L);
 LUAI_FUNC void luaS_remove (lua_State *L, TString *ts);
@@ -44,6 +88,18 @@ LUAI_FUNC Udata *luaS_newudata (lua_State *L, size_t s);
 LUAI_FUNC TString *luaS_newlstr (lua_State *L, const char *str, size_t l);
 LUAI_FUNC TString *luaS_new (lua_State *L, const char *str);
 LUAI_FUNC TString *luaS_createlngstrobj (lua_State *L, size_t l);
+LUAI_FUNC TString *luaS_newsub (lua_State *L, TString *ts, size_t pos,
+                                              size_t l);
+LUAI_FUNC void luaS_detach (lua_State *L, TString *ts);
+LUAI_FUNC TString *luaS_pushopen (lua_State *L, size_t l);
+LUAI_FUNC void luaS_resizeopen (lua_State *L, TString *ts, size_t l);
+LUAI_FUNC TString *luaS_closeopen (lua_State *L, TString *ts, size_t l);
+LUAI_FUNC TString *luaS_newextlstr (lua_State *L, const char *s, size_t l,
+                                    lua_Alloc falloc, void *ud);
+LUAI_FUNC int luaS_canextend (TString *ts);
+LUAI_FUNC TString *luaS_extend (lua_State *L, TString *ts, size_t tl,
+                                char **p);
+LUAI_FUNC void luaS_freelngstr (lua_State *L, TString *ts);
 
 
 #endif
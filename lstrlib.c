@@ -39,6 +39,11 @@
 #define uchar(c)	((unsigned char)(c))
 
 
+/* a word with all bytes equal to 1 and to 0x80 */
+#define WONES		((size_t)~(size_t)0 / UCHAR_MAX)
+#define WHIGHS		(WONES * (UCHAR_MAX / 2 + 1))
+
+
 /*
 ** Some sizes are better limited to fit in 'int', but must also fit in
 ** 'size_t'. (We assume that 'lua_Integer' cannot be smaller than 'int'.)
@@ -69,38 +74,131 @@ static lua_Integer posrelat (lua_Integer pos, size_t len) {
 
 static int str_sub (lua_State *L) {
   size_t l;
-  const char *s = luaL_checklstring(L, 1, &l);
-  lua_Integer start = posrelat(luaL_checkinteger(L, 2), l);
-  lua_Integer end = posrelat(luaL_optinteger(L, 3, -1), l);
+  lua_Integer start, end;
+  if (lua_type(L, 1) == LUA_TSTRING)  /* no need to access its contents */
+    l = lua_rawlen(L, 1);
+  else
+    luaL_checklstring(L, 1, &l);  /* (converts a number in place) */
+  start = posrelat(luaL_checkinteger(L, 2), l);
+  end = posrelat(luaL_optinteger(L, 3, -1), l);
   if (start < 1) start = 1;
   if (end > (lua_Integer)l) end = l;
-  if (start <= end)
-    lua_pushlstring(L, s + start - 1, (size_t)(end - start) + 1);
+  if (start <= end)  /* result may share the contents of the subject */
+    lua_pushsubstring(L, 1, (size_t)start - 1, (size_t)(end - start) + 1);
   else lua_pushliteral(L, "");
   return 1;
 }
 
 
+/* masks with alternating groups of 8 and 16 zero and one bits */
+#define MASK8		(~(size_t)0 / 0x101)
+#define MASK16		(~(size_t)0 / 0x10001)
+
+/*
+** Reverses the order of the bytes in word 'w' (with up to 8 bytes),
+** swapping adjacent bytes, then adjacent pairs, then its halves.
+*/
+static size_t revword (size_t w) {
+  const int half = (int)sizeof(size_t) * 4;  /* half the bits in 'w' */
+  if (half > 8)
+    w = ((w >> 8) & MASK8) | ((w & MASK8) << 8);
+  if (half > 16)
+    w = ((w >> 16) & MASK16) | ((w & MASK16) << 16);
+  return (w >> half) | (w << half);
+}
+
+
 static int str_reverse (lua_State *L) {
-  size_t l, i;
+  size_t l, i = 0;
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i = 0; i < l; i++)
+  for (; l - i >= sizeof(size_t); i += sizeof(size_t)) {  /* whole words */
+    size_t w;
+    memcpy(&w, s + (l - i - sizeof(size_t)), sizeof(size_t));
+    w = revword(w);
+    memcpy(p + i, &w, sizeof(size_t));
+  }
+  for (; i < l; i++)
     p[i] = s[l - i - 1];
   luaL_pushresultsize(&b, l);
   return 1;
 }
 
 
+/*
+** {======================================================
+** Case mapping
+** When the current locale maps ASCII letters as the C locale does,
+** words of long strings with only ASCII chars are mapped with integer
+** operations. (All locales are assumed to map other ASCII chars to
+** themselves.)
+** =======================================================
+*/
+
+/*
+** minimum length of a string to be mapped by words (also, how many
+** chars are mapped one by one after a word with a non-ASCII char)
+*/
+#if !defined(MINCASEWORDS)
+#define MINCASEWORDS	64
+#endif
+
+/*
+** Toggles the case of the bytes of an ASCII-only word 'w' that are
+** in ['lo', 'hi']. (Adding a byte to '0x80 - lo' sets its high bit iff
+** the byte is at least 'lo', without carries out of any byte.)
+*/
+#define casemapword(w,lo,hi)  ((w) ^ (((((w) + WONES * (0x80 - (lo))) & \
+	~((w) + WONES * (0x7f - (hi)))) & WHIGHS) >> 2))
+
+
+/* check whether 'f' maps the letters in ['lo', 'hi'] as the C locale */
+static int stdletters (int (*f) (int), int lo, int hi) {
+  int c;
+  for (c = lo; c <= hi; c++) {
+    if (f(c) != (c ^ 0x20))
+      return 0;
+  }
+  return 1;
+}
+
+
+/*
+** Maps the leading words of 's' (with length 'l') that have only ASCII
+** chars, toggling the case of bytes in ['lo', 'hi']; returns how many
+** bytes were mapped.
+*/
+static size_t casemapwords (char *p, const char *s, size_t l,
+                                                   int lo, int hi) {
+  size_t i;
+  for (i = 0; l - i >= sizeof(size_t); i += sizeof(size_t)) {
+    size_t w;
+    memcpy(&w, s + i, sizeof(size_t));
+    if ((w & WHIGHS) != 0)  /* some non-ASCII char? */
+      break;
+    w = casemapword(w, lo, hi);
+    memcpy(p + i, &w, sizeof(size_t));
+  }
+  return i;
+}
+
+
 static int str_lower (lua_State *L) {
   size_t l;
-  size_t i;
+  size_t i = 0;
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i=0; i<l; i++)
-    p[i] = tolower(uchar(s[i]));
+  int words = (l >= MINCASEWORDS && stdletters(tolower, 'A', 'Z'));
+  while (i < l) {
+    size_t e;
+    if (words)
+      i += casemapwords(p + i, s + i, l - i, 'A', 'Z');
+    e = (l - i > MINCASEWORDS) ? i + MINCASEWORDS : l;
+    for (; i < e; i++)  /* chars after a non-ASCII char go one by one */
+      p[i] = tolower(uchar(s[i]));
+  }
   luaL_pushresultsize(&b, l);
   return 1;
 }
@@ -108,16 +206,31 @@ static int str_lower (lua_State *L) {
 
 static int str_upper (lua_State *L) {
   size_t l;
-  size_t i;
+  size_t i = 0;
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i=0; i<l; i++)
-    p[i] = toupper(uchar(s[i]));
+  int words = (l >= MINCASEWORDS && stdletters(toupper, 'a', 'z'));
+  while (i < l) {
+    size_t e;
+    if (words)
+      i += casemapwords(p + i, s + i, l - i, 'a', 'z');
+    e = (l - i > MINCASEWORDS) ? i + MINCASEWORDS : l;
+    for (; i < e; i++)  /* chars after a non-ASCII char go one by one */
+      p[i] = toupper(uchar(s[i]));
+  }
   luaL_pushresultsize(&b, l);
   return 1;
 }
 
+/* }====================================================== */
+
+
+/* 'str_rep' doubles its copies up to this size */
+#if !defined(REPBLOCK)
+#define REPBLOCK	8192
+#endif
+
 
 static int str_rep (lua_State *L) {
   size_t l, lsep;
@@ -131,14 +244,24 @@ static int str_rep (lua_State *L) {
     size_t totallen = (size_t)n * l + (size_t)(n - 1) * lsep;
     luaL_Buffer b;
     char *p = luaL_buffinitsize(L, &b, totallen);
-    while (n-- > 1) {  /* first n-1 copies (followed by separator) */
-      memcpy(p, s, l * sizeof(char)); p += l;
-      if (lsep > 0) {  /* empty 'memcpy' is not that cheap */
-        memcpy(p, sep, lsep * sizeof(char));
-        p += lsep;
+    if (l + lsep == 1)  /* repeating a single char? */
+      memset(p, (l == 1) ? *s : *sep, totallen);
+    else {
+      size_t done = l + lsep;  /* first copy and its separator */
+      size_t blk = done;  /* size of each next copy (whole periods) */
+      memcpy(p, s, l * sizeof(char));
+      if (done > totallen)  /* only one copy? */
+        done = totallen;  /* (no separator) */
+      else
+        memcpy(p + l, sep, lsep * sizeof(char));
+      while (done < totallen) {  /* copy from start of result */
+        size_t m = (totallen - done < blk) ? totallen - done : blk;
+        memcpy(p + done, p, m * sizeof(char));
+        done += m;
+        if (blk < REPBLOCK)
+          blk = done;  /* double the copies, for fewer 'memcpy' calls */
       }
     }
-    memcpy(p, s, l * sizeof(char));  /* last copy (not followed by separator) */
     luaL_pushresultsize(&b, totallen);
   }
   return 1;
@@ -211,11 +334,38 @@ static int str_dump (lua_State *L) {
 #define CAP_POSITION	(-2)
 
 
+/* size of a set of characters (as a bitmap) */
+#define CSETSIZE	(UCHAR_MAX / CHAR_BIT + 1)
+
+#define testcset(set,c)	((set)[(c) / CHAR_BIT] & (1u << ((c) % CHAR_BIT)))
+
+
+/* single-char class at some position of a compiled pattern */
+typedef struct PatItem {
+  int end;  /* offset of the end of the class */
+  int set;  /* index of its set of characters (-1 if no class here) */
+  int live;  /* must non-ASCII chars be checked against the locale? */
+} PatItem;
+
+
+/* compiled pattern (see 'compilepattern') */
+typedef struct Pattern {
+  int first;  /* offset of a class where a match must start (or -1) */
+  int prefix;  /* length of literal prefix of the pattern */
+  int nsets;  /* number of sets in use */
+  PatItem *items;  /* one for each position of the pattern */
+  unsigned char (*sets)[CSETSIZE];
+} Pattern;
+
+
 typedef struct MatchState {
   const char *src_init;  /* init of source string */
   const char *src_end;  /* end ('\0') of source string */
+  const char *p_init;  /* init of pattern (including any '^') */
   const char *p_end;  /* end ('\0') of pattern */
+  const Pattern *pat;  /* compiled pattern (or NULL) */
   lua_State *L;
+  int srcidx;  /* stack index of source string */
   int matchdepth;  /* control for recursive depth (to avoid C stack overflow) */
   unsigned char level;  /* total number of captures (finished or unfinished) */
   struct {
@@ -256,6 +406,8 @@ static int capture_to_close (MatchState *ms) {
 
 
 static const char *classend (MatchState *ms, const char *p) {
+  if (ms->pat != NULL)  /* compiled pattern? */
+    return ms->p_init + ms->pat->items[p - ms->p_init].end;
   switch (*p++) {
     case L_ESC: {
       if (p == ms->p_end)
@@ -322,19 +474,30 @@ static int matchbracketclass (int c, const char *p, const char *ec) {
 }
 
 
+/* check whether char 'c' is in the single-char class 'p' ('ep' its end) */
+static int matchitem (int c, const char *p, const char *ep) {
+  switch (*p) {
+    case '.': return 1;  /* matches any char */
+    case L_ESC: return match_class(c, uchar(*(p+1)));
+    case '[': return matchbracketclass(c, p, ep-1);
+    default:  return (uchar(*p) == c);
+  }
+}
+
+
 static int singlematch (MatchState *ms, const char *s, const char *p,
                         const char *ep) {
   if (s >= ms->src_end)
     return 0;
-  else {
+  else if (ms->pat != NULL) {  /* compiled pattern? */
     int c = uchar(*s);
-    switch (*p) {
-      case '.': return 1;  /* matches any char */
-      case L_ESC: return match_class(c, uchar(*(p+1)));
-      case '[': return matchbracketclass(c, p, ep-1);
-      default:  return (uchar(*p) == c);
-    }
+    const PatItem *it = &ms->pat->items[p - ms->p_init];
+    if (c > 0x7F && it->live)
+      return matchitem(c, p, ms->p_init + it->end);
+    return testcset(ms->pat->sets[it->set], c) != 0;
   }
+  else
+    return matchitem(uchar(*s), p, ep);
 }
 
 
@@ -525,33 +688,460 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 
 
 
+/*
+** {======================================================
+** Literal search
+** 'lmemfind' looks for the first char of 's2' with 'memchr' while that
+** char is rare in 's1'. When it is frequent, it switches to checking
+** the first and last chars of 's2' for a word of positions at a time
+** (using plain integer operations), calling 'memcmp' only for the
+** positions where both match.
+** =======================================================
+*/
+
+/* true when some byte in word 'w' is zero (or may be, below a zero) */
+#define haszerobyte(w)	((((w) - WONES) & ~(w) & WHIGHS) != 0)
+
+/* 'memchr' finds this many false candidates per byte before switching */
+#define MAXFALSEHITS	64
+
+
+static const char *wordfind (const char *s1, size_t l1,
+                             const char *s2, size_t l2) {
+  size_t first = WONES * uchar(s2[0]);
+  size_t last = WONES * uchar(s2[l2 - 1]);
+  const char *s = s1;
+  const char *end = s1 + (l1 - l2 + 1);  /* last position to try + 1 */
+  for (; (size_t)(end - s) >= sizeof(size_t); s += sizeof(size_t)) {
+    size_t a, b;
+    memcpy(&a, s, sizeof(size_t));  /* first chars of next positions */
+    memcpy(&b, s + l2 - 1, sizeof(size_t));  /* their last chars */
+    a = (a ^ first) | (b ^ last);  /* zero where both chars match */
+    if (haszerobyte(a)) {  /* some candidate? */
+      size_t i;
+      for (i = 0; i < sizeof(size_t); i++) {
+        if (s[i] == s2[0] && s[i + l2 - 1] == s2[l2 - 1] &&
+            memcmp(s + i + 1, s2 + 1, l2 - 2) == 0)
+          return s + i;
+      }
+    }
+  }
+  for (; s < end; s++) {  /* remaining positions */
+    if (s[0] == s2[0] && memcmp(s + 1, s2 + 1, l2 - 1) == 0)
+      return s;
+  }
+  return NULL;
+}
+
+
 static const char *lmemfind (const char *s1, size_t l1,
                                const char *s2, size_t l2) {
   if (l2 == 0) return s1;  /* empty strings are everywhere */
   else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
+  else if (l2 == 1) return (const char *)memchr(s1, *s2, l1);
   else {
-    const char *init;  /* to search for a '*s2' inside 's1' */
-    l2--;  /* 1st char will be checked by 'memchr' */
-    l1 = l1-l2;  /* 's2' cannot be found after that */
-    while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
-      init++;   /* 1st char is already checked */
-      if (memcmp(init, s2+1, l2) == 0)
-        return init-1;
-      else {  /* correct 'l1' and 's1' to try again */
-        l1 -= init-s1;
-        s1 = init;
-      }
+    const char *s = s1;
+    const char *end = s1 + (l1 - l2 + 1);  /* last position to try + 1 */
+    size_t fails = 0;  /* number of false candidates */
+    while (s < end && (s = (const char *)memchr(s, *s2, end - s)) != NULL) {
+      if (s[l2 - 1] == s2[l2 - 1] && memcmp(s + 1, s2 + 1, l2 - 2) == 0)
+        return s;
+      s++;
+      if (++fails * MAXFALSEHITS > (size_t)(s - s1))  /* too many? */
+        return wordfind(s, l1 - (s - s1), s2, l2);
     }
     return NULL;  /* not found */
   }
 }
 
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Compiled patterns
+** Patterns used more than once are compiled: for each position where
+** 'match' may look for a single-char class, the compiled pattern keeps
+** the end of that class and the set of characters it matches, as a
+** bitmap. Sets are computed when the pattern is compiled, except that
+** classes depending on the locale (such as '%a') are checked at match
+** time for non-ASCII characters (all locales are assumed to agree on
+** ASCII). Compiled patterns are kept in a cache shared by the string
+** functions (their first upvalue), which keeps the PATCACHESIZE most
+** recently used patterns. Compiled formats (for 'string.format') are
+** kept in a similar cache (their second upvalue), with FMTCACHESIZE
+** entries, as programs often use many formats for logging.
+** A cache is a userdata with a fixed array of slots, in order from the
+** most to the least recently used. Its uservalue is a table anchoring,
+** at the slot's index 'i', the string (at 'i') and its compiled form
+** (at 'size' + 'i'), so that replacing an entry never adds keys
+** to that table. A string enters the cache only when it is seen again
+** shortly after its first use (as told by a small table of hashes), so
+** that strings built on the fly are never compiled. Compiling costs
+** much more than a hit saves, so if a period of CACHEPERIOD lookups has
+** more than one new entry for each ADDCOST hits, the cache stops taking
+** new entries for a while, doubling that pause each time.
+** =======================================================
+*/
+
+/* upvalues with the caches */
+#define PATCACHE	1
+#define FMTCACHE	2
+
+/* number of entries kept in each cache */
+#if !defined(PATCACHESIZE)
+#define PATCACHESIZE	32
+#endif
+
+#if !defined(FMTCACHESIZE)
+#define FMTCACHESIZE	64
+#endif
+
+/* maximum length of a pattern (or format) to be compiled */
+#if !defined(MAXPATCOMP)
+#define MAXPATCOMP	256
+#endif
+
+
+/* number of hashes of strings seen once */
+#if !defined(CACHESEEN)
+#define CACHESEEN	64
+#endif
+
+/* number of lookups between checks of the efficiency of a cache */
+#define CACHEPERIOD	1024
+
+/* number of hits that pay for a new entry */
+#define ADDCOST		16
+
+/* maximum number of periods a cache stays closed to new entries */
+#define MAXPAUSE	64
+
+
+typedef struct CacheSlot {
+  const char *s;  /* contents of the string (anchored by the cache) */
+  size_t l;  /* its length */
+  unsigned int h;  /* its hash */
+  int idx;  /* its index in the cache table */
+  void *e;  /* its compiled form */
+} CacheSlot;
+
+
+typedef struct PatCache {
+  unsigned int seen[CACHESEEN];  /* hashes of strings seen once */
+  int size;  /* number of slots */
+  int n;  /* number of slots in use */
+  int uses;  /* lookups in current period */
+  int hits;  /* lookups that found their string, in current period */
+  int adds;  /* new entries in current period */
+  int pause;  /* periods to go without new entries */
+  int backoff;  /* length of the next pause */
+  CacheSlot slot[1];  /* variable length; most recently used first */
+} PatCache;
+
+
+/* check whether 'c' matches only itself (outside a class) */
+#define isliteral(c)  \
+	((c) != '\0' && (c) != ')' && strchr(SPECIALS, (c)) == NULL)
+
+#define isrepetition(c)	((c) == '?' || (c) == '+' || (c) == '*' || (c) == '-')
+
+
+/* end of the single-char class at 'p' (or NULL if it is malformed) */
+static const char *itemend (const char *p, const char *pend) {
+  switch (*p++) {
+    case L_ESC: return (p < pend) ? p + 1 : NULL;
+    case '[': {
+      if (*p == '^') p++;
+      do {  /* look for a ']' */
+        if (p >= pend) return NULL;
+        if (*(p++) == L_ESC && p < pend)
+          p++;  /* skip escapes (e.g. '%]') */
+      } while (*p != ']');
+      return p + 1;
+    }
+    default: return p;
+  }
+}
+
+
+/* check whether class at 'p' uses a class that depends on the locale */
+static int islive (const char *p, const char *ep) {
+  for (; p < ep; p++) {
+    if (*p == L_ESC) {
+      p++;
+      if (*p != '\0' && strchr("acglpsuw", tolower(uchar(*p))) != NULL)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+
+static void additem (Pattern *pat, const char *p0, const char *p,
+                                                   const char *ep) {
+  PatItem *it;
+  if (pat == NULL) return;  /* only checking the pattern */
+  it = &pat->items[p - p0];
+  if (it->set < 0) {  /* new item? */
+    unsigned char *set = pat->sets[pat->nsets];
+    int c;
+    it->set = pat->nsets++;
+    it->end = (int)(ep - p0);
+    it->live = islive(p, ep);
+    memset(set, 0, CSETSIZE);
+    for (c = 0; c <= UCHAR_MAX; c++) {
+      if (matchitem(c, p, ep))
+        set[c / CHAR_BIT] |= 1u << (c % CHAR_BIT);
+    }
+  }
+}
+
+
+/*
+** Walks pattern 'p0' from 'p', visiting the same positions as 'match'
+** and adding to 'pat' (if not NULL) each single-char class. Returns 0
+** if the pattern is malformed (so that 'match' raises the error).
+*/
+static int walkpattern (Pattern *pat, const char *p0, const char *p,
+                                                      const char *pend) {
+  while (p < pend) {
+    const char *ep;
+    switch (*p) {
+      case '(': case ')': p++; continue;
+      case '$': {
+        if (p + 1 == pend) return 1;
+        break;  /* else a single char */
+      }
+      case L_ESC: {
+        if (*(p + 1) == 'b') {
+          if (pend - p < 4) return 0;
+          p += 4; continue;
+        }
+        else if (*(p + 1) == 'f') {
+          p += 2;
+          if (*p != '[' || (ep = itemend(p, pend)) == NULL) return 0;
+          additem(pat, p0, p, ep);
+          p = ep; continue;
+        }
+        else if (isdigit(uchar(*(p + 1)))) {
+          p += 2; continue;
+        }
+        break;  /* else a single-char class */
+      }
+    }
+    if ((ep = itemend(p, pend)) == NULL) return 0;
+    additem(pat, p0, p, ep);
+    p = ep;
+    if (p < pend && isrepetition(*p))
+      p++;  /* skip repetition */
+  }
+  return 1;
+}
+
+
+/* walks pattern both as anchored and as not anchored (for 'gmatch') */
+static int walkboth (Pattern *pat, const char *p, size_t lp) {
+  return walkpattern(pat, p, p, p + lp) &&
+         (*p != '^' || walkpattern(pat, p, p + 1, p + lp));
+}
+
+
+/*
+** Creates a compiled pattern (a full userdata, on the top of the stack)
+** for a well-formed pattern 'p'.
+*/
+static Pattern *compilepattern (lua_State *L, const char *p, size_t lp) {
+  size_t i;
+  Pattern *pat = (Pattern *)lua_newuserdata(L, sizeof(Pattern) +
+                              lp * (sizeof(PatItem) + CSETSIZE));
+  pat->nsets = 0;
+  pat->items = (PatItem *)(pat + 1);
+  pat->sets = (unsigned char (*)[CSETSIZE])(pat->items + lp);
+  for (i = 0; i < lp; i++)
+    pat->items[i].set = -1;
+  walkboth(pat, p, lp);
+  pat->first = -1;
+  if (lp > 0 && pat->items[0].set >= 0) {  /* starts with a class? */
+    const char *ep = p + pat->items[0].end;
+    if (ep == p + lp || (*ep != '?' && *ep != '*' && *ep != '-'))
+      pat->first = 0;  /* a match must start with a char in that class */
+  }
+  for (i = 0; i < lp && isliteral(p[i]); i++) {
+    if (i + 1 < lp && isrepetition(p[i + 1]))
+      break;  /* repeated char is not part of the prefix */
+  }
+  pat->prefix = (int)i;
+  return pat;
+}
+
+
+static unsigned int cachehash (const char *s, size_t l) {
+  unsigned int h = (unsigned int)l;
+  size_t step = (l >> 5) + 1;
+  for (; l >= step; l -= step)
+    h ^= ((h << 5) + (h >> 2) + uchar(s[l - 1]));
+  return h;
+}
+
+
+/* starts a new period, opening or closing the cache to new entries */
+static void newperiod (PatCache *pc) {
+  if (pc->pause > 0)
+    pc->pause--;
+  else if (pc->adds > pc->hits / ADDCOST) {  /* misses dominate? */
+    pc->pause = pc->backoff;
+    if (pc->backoff < MAXPAUSE)
+      pc->backoff *= 2;
+  }
+  else
+    pc->backoff = 1;
+  pc->uses = pc->hits = pc->adds = 0;
+}
+
+
+/*
+** Looks up string 's' (with length 'l') in cache 'c' (an upvalue). If
+** found, pushes its compiled form (to keep it alive) and returns it.
+** Otherwise returns NULL, setting '*add' to whether the string should
+** now enter the cache.
+*/
+static void *cachelookup (lua_State *L, int c, const char *s, size_t l,
+                                                int *add) {
+  PatCache *pc = (PatCache *)lua_touserdata(L, lua_upvalueindex(c));
+  unsigned int h = cachehash(s, l);
+  unsigned int *seen = &pc->seen[h % CACHESEEN];
+  int i;
+  if (++pc->uses >= CACHEPERIOD)
+    newperiod(pc);
+  for (i = 0; i < pc->n; i++) {
+    CacheSlot *sl = &pc->slot[i];
+    if (sl->h == h && sl->l == l &&
+        (sl->s == s || memcmp(sl->s, s, l) == 0)) {  /* found? */
+      CacheSlot found = *sl;
+      memmove(pc->slot + 1, pc->slot, i * sizeof(CacheSlot));
+      pc->slot[0] = found;  /* move it to the front */
+      pc->hits++;
+      lua_getuservalue(L, lua_upvalueindex(c));
+      lua_rawgeti(L, -1, pc->size + found.idx);
+      lua_remove(L, -2);  /* remove cache table */
+      return found.e;
+    }
+  }
+  *add = (pc->pause == 0 && *seen == h);  /* seen recently? */
+  *seen = h;
+  return NULL;
+}
+
+
+/*
+** Adds to cache 'c' the string at index 'arg' (with contents 's' and
+** length 'l') with the compiled form 'e' on the top of the stack,
+** reusing the slot of the least recently used string if the cache is
+** full. The cache table has all its indices preallocated, so nothing
+** here can raise an error with a slot not anchored.
+*/
+static void cacheadd (lua_State *L, int c, int arg, const char *s,
+                                         size_t l, void *e) {
+  PatCache *pc = (PatCache *)lua_touserdata(L, lua_upvalueindex(c));
+  CacheSlot sl;
+  sl.s = s; sl.l = l; sl.h = cachehash(s, l); sl.e = e;
+  if (pc->n < pc->size)
+    sl.idx = ++pc->n;
+  else
+    sl.idx = pc->slot[pc->size - 1].idx;  /* evict last slot */
+  memmove(pc->slot + 1, pc->slot, (pc->n - 1) * sizeof(CacheSlot));
+  pc->slot[0] = sl;
+  pc->adds++;
+  lua_getuservalue(L, lua_upvalueindex(c));
+  lua_pushvalue(L, arg);
+  lua_rawseti(L, -2, sl.idx);
+  lua_pushvalue(L, -2);
+  lua_rawseti(L, -2, pc->size + sl.idx);
+  lua_pop(L, 1);  /* remove cache table */
+}
+
+
+/*
+** Gets from the cache the compiled form of the pattern at index 'arg'
+** (with contents 'p'), compiling it if it was used recently. Leaves it
+** (or nil) on the stack, to keep it alive.
+*/
+static const Pattern *getpattern (lua_State *L, int arg, const char *p,
+                                                         size_t lp) {
+  if (lp <= MAXPATCOMP) {  /* not too long? */
+    int add;
+    Pattern *pat = (Pattern *)cachelookup(L, PATCACHE, p, lp, &add);
+    if (pat != NULL)
+      return pat;
+    else if (add && walkboth(NULL, p, lp)) {
+      pat = compilepattern(L, p, lp);
+      cacheadd(L, PATCACHE, arg, p, lp, pat);
+      return pat;
+    }
+  }
+  lua_pushnil(L);
+  return NULL;
+}
+
+
+/*
+** Makes 'ms' use the compiled form (if any) of the pattern at index
+** 'arg', leaving its cache entry (or nil) on the top of the stack.
+*/
+static void usepattern (MatchState *ms, int arg) {
+  size_t lp;
+  const char *p = lua_tolstring(ms->L, arg, &lp);
+  ms->p_init = p;
+  ms->pat = getpattern(ms->L, arg, p, lp);
+}
+
+
+/* skips source positions where no match can start */
+static const char *skipstart (MatchState *ms, const char *s) {
+  if (ms->pat != NULL && ms->pat->prefix > 0) {  /* literal prefix? */
+    const char *s1 = lmemfind(s, ms->src_end - s, ms->p_init,
+                              ms->pat->prefix);
+    return (s1 != NULL) ? s1 : ms->src_end;
+  }
+  else if (ms->pat != NULL && ms->pat->first >= 0) {
+    const char *p = ms->p_init + ms->pat->first;
+    while (s < ms->src_end && !singlematch(ms, s, p, NULL))
+      s++;
+  }
+  return s;
+}
+
+
+static void newpatcache (lua_State *L, int size) {
+  PatCache *pc = (PatCache *)lua_newuserdata(L, sizeof(PatCache) +
+                                      (size - 1) * sizeof(CacheSlot));
+  memset(pc->seen, 0, sizeof(pc->seen));
+  pc->size = size;
+  pc->n = pc->uses = pc->hits = pc->adds = pc->pause = 0;
+  pc->backoff = 1;
+  lua_createtable(L, 2 * size, 0);
+  lua_setuservalue(L, -2);
+}
+
+/* }====================================================== */
+
+
+/*
+** push the 'l' bytes of the source string starting at 's' (which may
+** share the contents of the source)
+*/
+static void pushsrcsub (MatchState *ms, const char *s, size_t l) {
+  lua_pushsubstring(ms->L, ms->srcidx, s - ms->src_init, l);
+}
+
 
 static void push_onecapture (MatchState *ms, int i, const char *s,
                                                     const char *e) {
   if (i >= ms->level) {
     if (i == 0)  /* ms->level == 0, too */
-      lua_pushlstring(ms->L, s, e - s);  /* add whole match */
+      pushsrcsub(ms, s, e - s);  /* add whole match */
     else
       luaL_error(ms->L, "invalid capture index %%%d", i + 1);
   }
@@ -561,7 +1151,7 @@ static void push_onecapture (MatchState *ms, int i, const char *s,
     if (l == CAP_POSITION)
       lua_pushinteger(ms->L, (ms->capture[i].init - ms->src_init) + 1);
     else
-      lua_pushlstring(ms->L, ms->capture[i].init, l);
+      pushsrcsub(ms, ms->capture[i].init, l);
   }
 }
 
@@ -591,10 +1181,13 @@ static int nospecials (const char *p, size_t l) {
 static void prepstate (MatchState *ms, lua_State *L,
                        const char *s, size_t ls, const char *p, size_t lp) {
   ms->L = L;
+  ms->srcidx = 1;  /* source is the first argument (except for 'gmatch') */
   ms->matchdepth = MAXCCALLS;
   ms->src_init = s;
   ms->src_end = s + ls;
+  ms->p_init = p;
   ms->p_end = p + lp;
+  ms->pat = NULL;
 }
 
 
@@ -632,8 +1225,11 @@ static int str_find_aux (lua_State *L, int find) {
       p++; lp--;  /* skip anchor character */
     }
     prepstate(&ms, L, s, ls, p, lp);
+    usepattern(&ms, 2);
     do {
       const char *res;
+      if (!anchor)
+        s1 = skipstart(&ms, s1);
       reprepstate(&ms);
       if ((res=match(&ms, s1, p)) != NULL) {
         if (find) {
@@ -676,6 +1272,7 @@ static int gmatch_aux (lua_State *L) {
   gm->ms.L = L;
   for (src = gm->src; src <= gm->ms.src_end; src++) {
     const char *e;
+    src = skipstart(&gm->ms, src);
     reprepstate(&gm->ms);
     if ((e = match(&gm->ms, src, gm->p)) != NULL && e != gm->lastmatch) {
       gm->src = gm->lastmatch = e;
@@ -694,8 +1291,10 @@ static int gmatch (lua_State *L) {
   lua_settop(L, 2);  /* keep them on closure to avoid being collected */
   gm = (GMatchState *)lua_newuserdata(L, sizeof(GMatchState));
   prepstate(&gm->ms, L, s, ls, p, lp);
+  gm->ms.srcidx = lua_upvalueindex(1);
+  usepattern(&gm->ms, 2);  /* pushes its cache entry (4th upvalue) */
   gm->src = s; gm->p = p; gm->lastmatch = NULL;
-  lua_pushcclosure(L, gmatch_aux, 3);
+  lua_pushcclosure(L, gmatch_aux, 4);
   return 1;
 }
 
@@ -773,13 +1372,19 @@ static int str_gsub (lua_State *L) {
   luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table expected");
-  luaL_buffinit(L, &b);
   if (anchor) {
     p++; lp--;  /* skip anchor character */
   }
   prepstate(&ms, L, src, srcl, p, lp);
+  usepattern(&ms, 2);
+  luaL_buffinit(L, &b);
   while (n < max_s) {
     const char *e;
+    if (!anchor) {
+      const char *s = skipstart(&ms, src);
+      luaL_addlstring(&b, src, s - src);  /* keep skipped chars */
+      src = s;
+    }
     reprepstate(&ms);  /* (re)prepare state for new match */
     if ((e = match(&ms, src, p)) != NULL && e != lastmatch) {  /* match? */
       n++;
@@ -978,38 +1583,326 @@ static void addliteral (lua_State *L, luaL_Buffer *b, int arg) {
 }
 
 
-static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
+/* a conversion specification of a format, with the text before it */
+typedef struct FmtItem {
+  size_t lit;  /* offset of the literal text before the conversion */
+  size_t llit;  /* length of that text */
+  int prec;  /* precision (-1 if absent) */
+  char conv;  /* conversion ('\0' if none) */
+  char simple;  /* true if conversion has no flags and no width */
+  char form[MAX_FORMAT];  /* C format for the conversion ('%...') */
+} FmtItem;
+
+
+/* compiled format (see 'compileformat') */
+typedef struct Format {
+  int nitems;
+  FmtItem items[1];  /* variable length */
+} Format;
+
+
+static const char *fmterror (lua_State *L, const char *msg) {
+  if (L != NULL)
+    luaL_error(L, "%s", msg);
+  return NULL;
+}
+
+
+/*
+** Reads the conversion specification at 'strfrmt' (after the '%') into
+** 'it', adding the length modifier to its C format. Returns the end of
+** the specification, or NULL if it is invalid (when 'L' is NULL;
+** otherwise it raises an error).
+*/
+static const char *scanformat (lua_State *L, const char *strfrmt,
+                                             FmtItem *it) {
   const char *p = strfrmt;
+  const char *lenmod;
+  char *form = it->form;
   while (*p != '\0' && strchr(FLAGS, *p) != NULL) p++;  /* skip flags */
   if ((size_t)(p - strfrmt) >= sizeof(FLAGS)/sizeof(char))
-    luaL_error(L, "invalid format (repeated flags)");
+    return fmterror(L, "invalid format (repeated flags)");
+  it->simple = (p == strfrmt && !isdigit(uchar(*p)));
   if (isdigit(uchar(*p))) p++;  /* skip width */
   if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
+  it->prec = -1;
   if (*p == '.') {
     p++;
-    if (isdigit(uchar(*p))) p++;  /* skip precision */
-    if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
+    it->prec = 0;
+    if (isdigit(uchar(*p))) it->prec = *(p++) - '0';  /* read precision */
+    if (isdigit(uchar(*p))) it->prec = it->prec * 10 + (*(p++) - '0');
   }
   if (isdigit(uchar(*p)))
-    luaL_error(L, "invalid format (width or precision too long)");
+    return fmterror(L, "invalid format (width or precision too long)");
+  switch (*p) {
+    case 'd': case 'i':
+    case 'o': case 'u': case 'x': case 'X':
+      lenmod = LUA_INTEGER_FRMLEN;
+      break;
+    case 'a': case 'A': case 'e': case 'E': case 'f':
+    case 'g': case 'G':
+      lenmod = LUA_NUMBER_FRMLEN;
+      break;
+    case 'c': case 'q': case 's':
+      lenmod = "";
+      break;
+    default: {  /* also treat cases 'pnLlh' */
+      if (L != NULL)
+        luaL_error(L, "invalid option '%%%c' to 'format'", *p);
+      return NULL;
+    }
+  }
   *(form++) = '%';
-  memcpy(form, strfrmt, ((p - strfrmt) + 1) * sizeof(char));
-  form += (p - strfrmt) + 1;
+  memcpy(form, strfrmt, (p - strfrmt) * sizeof(char));
+  form += p - strfrmt;
+  strcpy(form, lenmod);
+  form += strlen(lenmod);
+  *(form++) = *p;
   *form = '\0';
-  return p;
+  it->conv = *p;
+  return p + 1;
+}
+
+
+/*
+** Writes integer 'n' in decimal into 'buff'; returns its length.
+*/
+static int fmtdec (char *buff, lua_Integer n) {
+  char temp[sizeof(lua_Integer) * CHAR_BIT];
+  int i = sizeof(temp);
+  int nb = 0;
+  lua_Unsigned u = (lua_Unsigned)n;
+  if (n < 0) {
+    buff[nb++] = '-';
+    u = 0u - u;
+  }
+  do {
+    temp[--i] = (char)('0' + u % 10);
+    u /= 10;
+  } while (u != 0);
+  memcpy(buff + nb, temp + i, sizeof(temp) - i);
+  return nb + (int)sizeof(temp) - i;
 }
 
 
 /*
-** add length modifier into formats
+** Writes integer 'n' in hexadecimal (as an unsigned number) into 'buff';
+** returns its length.
 */
-static void addlenmod (char *form, const char *lenmod) {
-  size_t l = strlen(form);
-  size_t lm = strlen(lenmod);
-  char spec = form[l - 1];
-  strcpy(form + l - 1, lenmod);
-  form[l + lm - 1] = spec;
-  form[l + lm] = '\0';
+static int fmthex (char *buff, lua_Integer n, int upper) {
+  const char *digits = (upper) ? "0123456789ABCDEF" : "0123456789abcdef";
+  char temp[sizeof(lua_Integer) * CHAR_BIT];
+  int i = sizeof(temp);
+  lua_Unsigned u = (lua_Unsigned)n;
+  do {
+    temp[--i] = digits[u & 0xf];
+    u >>= 4;
+  } while (u != 0);
+  memcpy(buff, temp + i, sizeof(temp) - i);
+  return (int)sizeof(temp) - i;
+}
+
+
+#if LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE	/* { */
+
+/* maximum precision handled by 'fmtfixed' */
+#define MAXFIXEDPREC	9
+
+/*
+** Writes 'x' into 'buff' as '%.<prec>f' would do, or returns 0 if it
+** cannot do it exactly. 'x' times 10^prec is computed with a single
+** rounding, so its integer part is exact and its rounding is correct,
+** except when it is too close to a tie (which 'sprintf' breaks using
+** the exact value of 'x').
+*/
+static int fmtfixed (char *buff, double x, int prec) {
+  static const double pow10[MAXFIXEDPREC + 1] =
+    {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+  char temp[32];  /* enough for 2^52 with MAXFIXEDPREC decimals */
+  int i = sizeof(temp);
+  int nb = 0;
+  double y, frac, margin;
+  lua_Unsigned d;
+  if (prec > MAXFIXEDPREC || !(x != 0 && x < 1e9 && x > -1e9))
+    return 0;  /* also rejects zeros (signed) and NaN */
+  if (x < 0) {
+    buff[nb++] = '-';
+    x = -x;
+  }
+  y = x * pow10[prec];
+  if (y >= 4503599627370496.0)  /* 2^52 */
+    return 0;
+  d = (lua_Unsigned)y;
+  frac = y - (double)d;  /* exact */
+  margin = y * DBL_EPSILON;
+  if (frac - 0.5 <= margin && 0.5 - frac <= margin)
+    return 0;  /* too close to a tie */
+  d += (frac > 0.5);
+  do {
+    temp[--i] = (char)('0' + d % 10);
+    d /= 10;
+    if (--prec == 0)
+      temp[--i] = lua_getlocaledecpoint();
+  } while (d != 0 || prec >= 0);
+  memcpy(buff + nb, temp + i, sizeof(temp) - i);
+  return nb + (int)sizeof(temp) - i;
+}
+
+#else					/* }{ */
+
+#define fmtfixed(buff,x,prec)	0
+
+#endif					/* } */
+
+
+/*
+** Adds to buffer 'b' the value at index 'arg' formatted by 'it'.
+** Conversions without flags or width for '%d', '%x', and '%f' are
+** done without 'sprintf'.
+*/
+static void addformat (lua_State *L, luaL_Buffer *b, int arg,
+                                     const FmtItem *it) {
+  char *buff = luaL_prepbuffsize(b, MAX_ITEM);  /* to put formatted item */
+  int nb = 0;  /* number of bytes in added item */
+  switch (it->conv) {
+    case 'c': {
+      nb = l_sprintf(buff, MAX_ITEM, it->form,
+                     (int)luaL_checkinteger(L, arg));
+      break;
+    }
+    case 'd': case 'i': {
+      lua_Integer n = luaL_checkinteger(L, arg);
+      if (it->simple && it->prec < 0)
+        nb = fmtdec(buff, n);
+      else
+        nb = l_sprintf(buff, MAX_ITEM, it->form, (LUAI_UACINT)n);
+      break;
+    }
+    case 'x': case 'X': {
+      lua_Integer n = luaL_checkinteger(L, arg);
+      if (it->simple && it->prec < 0)
+        nb = fmthex(buff, n, it->conv == 'X');
+      else
+        nb = l_sprintf(buff, MAX_ITEM, it->form, (LUAI_UACINT)n);
+      break;
+    }
+    case 'o': case 'u': {
+      lua_Integer n = luaL_checkinteger(L, arg);
+      nb = l_sprintf(buff, MAX_ITEM, it->form, (LUAI_UACINT)n);
+      break;
+    }
+    case 'a': case 'A':
+      nb = lua_number2strx(L, buff, MAX_ITEM, it->form,
+                              luaL_checknumber(L, arg));
+      break;
+    case 'f': {
+      lua_Number n = luaL_checknumber(L, arg);
+      if (it->simple)
+        nb = fmtfixed(buff, n, (it->prec < 0) ? 6 : it->prec);
+      if (nb == 0)
+        nb = l_sprintf(buff, MAX_ITEM, it->form, (LUAI_UACNUMBER)n);
+      break;
+    }
+    case 'e': case 'E': case 'g': case 'G': {
+      lua_Number n = luaL_checknumber(L, arg);
+      nb = l_sprintf(buff, MAX_ITEM, it->form, (LUAI_UACNUMBER)n);
+      break;
+    }
+    case 'q': {
+      addliteral(L, b, arg);
+      break;
+    }
+    case 's': {
+      size_t l;
+      const char *s = luaL_tolstring(L, arg, &l);
+      if (it->form[2] == '\0')  /* no modifiers? */
+        luaL_addvalue(b);  /* keep entire string */
+      else {
+        luaL_argcheck(L, l == strlen(s), arg, "string contains zeros");
+        if (it->prec < 0 && l >= 100) {
+          /* no precision and string is too long to be formatted */
+          luaL_addvalue(b);  /* keep entire string */
+        }
+        else {  /* format the string into 'buff' */
+          nb = l_sprintf(buff, MAX_ITEM, it->form, s);
+          lua_pop(L, 1);  /* remove result from 'luaL_tolstring' */
+        }
+      }
+      break;
+    }
+    default: lua_assert(0);
+  }
+  lua_assert(nb < MAX_ITEM);
+  luaL_addsize(b, nb);
+}
+
+
+/*
+** Walks format 'strfrmt', filling the items of 'fmt' (if not NULL).
+** Returns the number of items, or -1 if the format is invalid (so that
+** 'str_format' raises the error).
+*/
+static int walkformat (Format *fmt, const char *strfrmt, size_t sfl) {
+  const char *s = strfrmt;
+  const char *strfrmt_end = strfrmt + sfl;
+  const char *lit = s;  /* start of current literal text */
+  FmtItem dummy;
+  int n = 0;
+  while (s < strfrmt_end) {
+    FmtItem *it = (fmt != NULL) ? &fmt->items[n] : &dummy;
+    if (*s != L_ESC) {
+      s++;
+      continue;
+    }
+    else if (*(s + 1) == L_ESC) {  /* %% */
+      it->llit = (s + 1) - lit;  /* keep one '%' in the literal */
+      it->conv = '\0';
+      s += 2;
+    }
+    else {
+      it->llit = s - lit;
+      if ((s = scanformat(NULL, s + 1, it)) == NULL)
+        return -1;
+    }
+    it->lit = lit - strfrmt;
+    lit = s;
+    n++;
+  }
+  if (lit < strfrmt_end) {  /* final literal text? */
+    if (fmt != NULL) {
+      FmtItem *it = &fmt->items[n];
+      it->lit = lit - strfrmt;
+      it->llit = strfrmt_end - lit;
+      it->conv = '\0';
+    }
+    n++;
+  }
+  return n;
+}
+
+
+/*
+** Gets from the cache the compiled form of the format at index 1 (with
+** contents 'strfrmt'), compiling it if it was used recently (as with
+** patterns). Leaves it (or nil) on the stack.
+*/
+static const Format *getformat (lua_State *L, const char *strfrmt,
+                                              size_t sfl) {
+  if (sfl <= MAXPATCOMP) {  /* not too long? */
+    int add, n;
+    Format *fmt = (Format *)cachelookup(L, FMTCACHE, strfrmt, sfl, &add);
+    if (fmt != NULL)
+      return fmt;
+    else if (add && (n = walkformat(NULL, strfrmt, sfl)) >= 0) {
+      fmt = (Format *)lua_newuserdata(L, sizeof(Format) +
+                                         n * sizeof(FmtItem));
+      fmt->nitems = walkformat(fmt, strfrmt, sfl);
+      cacheadd(L, FMTCACHE, 1, strfrmt, sfl, fmt);
+      return fmt;
+    }
+  }
+  lua_pushnil(L);
+  return NULL;
 }
 
 
@@ -1019,73 +1912,34 @@ static int str_format (lua_State *L) {
   size_t sfl;
   const char *strfrmt = luaL_checklstring(L, arg, &sfl);
   const char *strfrmt_end = strfrmt+sfl;
+  const Format *fmt = getformat(L, strfrmt, sfl);
   luaL_Buffer b;
   luaL_buffinit(L, &b);
-  while (strfrmt < strfrmt_end) {
-    if (*strfrmt != L_ESC)
-      luaL_addchar(&b, *strfrmt++);
-    else if (*++strfrmt == L_ESC)
-      luaL_addchar(&b, *strfrmt++);  /* %% */
-    else { /* format item */
-      char form[MAX_FORMAT];  /* to store the format ('%...') */
-      char *buff = luaL_prepbuffsize(&b, MAX_ITEM);  /* to put formatted item */
-      int nb = 0;  /* number of bytes in added item */
-      if (++arg > top)
-        luaL_argerror(L, arg, "no value");
-      strfrmt = scanformat(L, strfrmt, form);
-      switch (*strfrmt++) {
-        case 'c': {
-          nb = l_sprintf(buff, MAX_ITEM, form, (int)luaL_checkinteger(L, arg));
-          break;
-        }
-        case 'd': case 'i':
-        case 'o': case 'u': case 'x': case 'X': {
-          lua_Integer n = luaL_checkinteger(L, arg);
-          addlenmod(form, LUA_INTEGER_FRMLEN);
-          nb = l_sprintf(buff, MAX_ITEM, form, (LUAI_UACINT)n);
-          break;
-        }
-        case 'a': case 'A':
-          addlenmod(form, LUA_NUMBER_FRMLEN);
-          nb = lua_number2strx(L, buff, MAX_ITEM, form,
-                                  luaL_checknumber(L, arg));
-          break;
-        case 'e': case 'E': case 'f':
-        case 'g': case 'G': {
-          lua_Number n = luaL_checknumber(L, arg);
-          addlenmod(form, LUA_NUMBER_FRMLEN);
-          nb = l_sprintf(buff, MAX_ITEM, form, (LUAI_UACNUMBER)n);
-          break;
-        }
-        case 'q': {
-          addliteral(L, &b, arg);
-          break;
-        }
-        case 's': {
-          size_t l;
-          const char *s = luaL_tolstring(L, arg, &l);
-          if (form[2] == '\0')  /* no modifiers? */
-            luaL_addvalue(&b);  /* keep entire string */
-          else {
-            luaL_argcheck(L, l == strlen(s), arg, "string contains zeros");
-            if (!strchr(form, '.') && l >= 100) {
-              /* no precision and string is too long to be formatted */
-              luaL_addvalue(&b);  /* keep entire string */
-            }
-            else {  /* format the string into 'buff' */
-              nb = l_sprintf(buff, MAX_ITEM, form, s);
-              lua_pop(L, 1);  /* remove result from 'luaL_tolstring' */
-            }
-          }
-          break;
-        }
-        default: {  /* also treat cases 'pnLlh' */
-          return luaL_error(L, "invalid option '%%%c' to 'format'",
-                               *(strfrmt - 1));
-        }
+  if (fmt != NULL) {  /* compiled format? */
+    int i;
+    for (i = 0; i < fmt->nitems; i++) {
+      const FmtItem *it = &fmt->items[i];
+      luaL_addlstring(&b, strfrmt + it->lit, it->llit);
+      if (it->conv != '\0') {
+        if (++arg > top)
+          luaL_argerror(L, arg, "no value");
+        addformat(L, &b, arg, it);
+      }
+    }
+  }
+  else {
+    while (strfrmt < strfrmt_end) {
+      if (*strfrmt != L_ESC)
+        luaL_addchar(&b, *strfrmt++);
+      else if (*++strfrmt == L_ESC)
+        luaL_addchar(&b, *strfrmt++);  /* %% */
+      else { /* format item */
+        FmtItem it;
+        if (++arg > top)
+          luaL_argerror(L, arg, "no value");
+        strfrmt = scanformat(L, strfrmt, &it);
+        addformat(L, &b, arg, &it);
       }
-      lua_assert(nb < MAX_ITEM);
-      luaL_addsize(&b, nb);
     }
   }
   luaL_pushresult(&b);
@@ -1286,6 +2140,27 @@ static KOption getdetails (Header *h, size_t totalsize,
 }
 
 
+/*
+** Read the repeat count of a numeric option ('[n]'), or return -1 if
+** there is none. All elements after the first are aligned by the
+** first one's alignment, so their size must be a multiple of it.
+*/
+static int getcount (Header *h, const char **fmt, KOption opt, int size) {
+  int count, align;
+  if (**fmt != '[' || (opt != Kint && opt != Kuint && opt != Kfloat))
+    return -1;
+  (*fmt)++;  /* skip '[' */
+  count = getnum(fmt, -1);
+  if (count < 0 || *((*fmt)++) != ']')
+    luaL_error(h->L, "invalid repeat count in format");
+  align = (size < h->maxalign) ? size : h->maxalign;
+  if (align > 1 && size % align != 0)
+    luaL_argerror(h->L, 1, "repeated option with size not multiple of "
+                           "its alignment");
+  return count;
+}
+
+
 /*
 ** Pack integer 'n' with 'size' bytes and 'islittle' endianness.
 ** The final 'if' handles the case when 'size' is larger than
@@ -1327,6 +2202,80 @@ static void copywithendian (volatile char *dest, volatile const char *src,
 }
 
 
+static void overflowerror (lua_State *L, int arg, int idx, const char *msg) {
+  if (idx > 0)  /* element of a table? */
+    msg = lua_pushfstring(L, "%s (at index %d) in table", msg, idx);
+  luaL_argerror(L, arg, msg);
+}
+
+
+/*
+** Pack integer 'n' for option 'opt' (Kint or Kuint) with 'size' bytes,
+** checking overflows (raised as errors on argument 'arg'; 'idx', if not
+** zero, is the index of 'n' in the table at 'arg').
+*/
+static void packinteger (lua_State *L, luaL_Buffer *b, Header *h,
+                         KOption opt, int size, lua_Integer n, int arg,
+                         int idx) {
+  if (opt == Kint) {  /* signed integers */
+    if (size < SZINT) {  /* need overflow check? */
+      lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
+      if (!(-lim <= n && n < lim))
+        overflowerror(L, arg, idx, "integer overflow");
+    }
+    packint(b, (lua_Unsigned)n, h->islittle, size, (n < 0));
+  }
+  else {  /* unsigned integers */
+    if (size < SZINT &&  /* need overflow check? */
+        (lua_Unsigned)n >= ((lua_Unsigned)1 << (size * NB)))
+      overflowerror(L, arg, idx, "unsigned overflow");
+    packint(b, (lua_Unsigned)n, h->islittle, size, 0);
+  }
+}
+
+
+static void packfloat (luaL_Buffer *b, Header *h, int size, lua_Number n) {
+  volatile Ftypes u;
+  char *buff = luaL_prepbuffsize(b, size);
+  if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
+  else if (size == sizeof(u.d)) u.d = (double)n;
+  else u.n = n;
+  /* move 'u' to final result, correcting endianness if needed */
+  copywithendian(buff, u.buff, size, h->islittle);
+  luaL_addsize(b, size);
+}
+
+
+/*
+** Pack 'count' elements of numeric option 'opt' from the table at
+** index 'arg'.
+*/
+static void packarray (lua_State *L, luaL_Buffer *b, Header *h,
+                       KOption opt, int size, int arg, int count) {
+  int i;
+  luaL_checktype(L, arg, LUA_TTABLE);
+  for (i = 1; i <= count; i++) {
+    int isnum;
+    lua_geti(L, arg, i);  /* (popped before using the buffer) */
+    if (opt == Kfloat) {
+      lua_Number n = lua_tonumberx(L, -1, &isnum);
+      lua_pop(L, 1);
+      if (!isnum) break;
+      packfloat(b, h, size, n);
+    }
+    else {
+      lua_Integer n = lua_tointegerx(L, -1, &isnum);
+      lua_pop(L, 1);
+      if (!isnum) break;
+      packinteger(L, b, h, opt, size, n, arg, i);
+    }
+  }
+  if (i <= count)
+    luaL_argerror(L, arg, lua_pushfstring(L,
+                     "invalid value (at index %d) in table", i));
+}
+
+
 static int str_pack (lua_State *L) {
   luaL_Buffer b;
   Header h;
@@ -1339,38 +2288,25 @@ static int str_pack (lua_State *L) {
   while (*fmt != '\0') {
     int size, ntoalign;
     KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
-    totalsize += ntoalign + size;
+    int count = getcount(&h, &fmt, opt, size);
+    totalsize += ntoalign;
     while (ntoalign-- > 0)
      luaL_addchar(&b, LUAL_PACKPADBYTE);  /* fill alignment */
     arg++;
+    if (count >= 0) {  /* repeated option? */
+      packarray(L, &b, &h, opt, size, arg, count);
+      totalsize += (size_t)size * count;
+      continue;
+    }
+    totalsize += size;
     switch (opt) {
-      case Kint: {  /* signed integers */
-        lua_Integer n = luaL_checkinteger(L, arg);
-        if (size < SZINT) {  /* need overflow check? */
-          lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
-          luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
-        }
-        packint(&b, (lua_Unsigned)n, h.islittle, size, (n < 0));
-        break;
-      }
-      case Kuint: {  /* unsigned integers */
-        lua_Integer n = luaL_checkinteger(L, arg);
-        if (size < SZINT)  /* need overflow check? */
-          luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
-                           arg, "unsigned overflow");
-        packint(&b, (lua_Unsigned)n, h.islittle, size, 0);
+      case Kint: case Kuint: {  /* integers */
+        packinteger(L, &b, &h, opt, size, luaL_checkinteger(L, arg),
+                    arg, 0);
         break;
       }
       case Kfloat: {  /* floating-point options */
-        volatile Ftypes u;
-        char *buff = luaL_prepbuffsize(&b, size);
-        lua_Number n = luaL_checknumber(L, arg);  /* get argument */
-        if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
-        else if (size == sizeof(u.d)) u.d = (double)n;
-        else u.n = n;
-        /* move 'u' to final result, correcting endianness if needed */
-        copywithendian(buff, u.buff, size, h.islittle);
-        luaL_addsize(&b, size);
+        packfloat(&b, &h, size, luaL_checknumber(L, arg));
         break;
       }
       case Kchar: {  /* fixed-size string */
@@ -1422,6 +2358,14 @@ static int str_packsize (lua_State *L) {
   while (*fmt != '\0') {
     int size, ntoalign;
     KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
+    int count = getcount(&h, &fmt, opt, size);
+    if (count >= 0) {  /* repeated option? */
+      luaL_argcheck(L, totalsize <= MAXSIZE - ntoalign &&
+                       (size_t)count <= (MAXSIZE - totalsize - ntoalign) / size,
+                       1, "format result too large");
+      totalsize += ntoalign + (size_t)size * count;
+      continue;
+    }
     size += ntoalign;  /* total space used by option */
     luaL_argcheck(L, totalsize <= MAXSIZE - size, 1,
                      "format result too large");
@@ -1473,6 +2417,36 @@ static lua_Integer unpackint (lua_State *L, const char *str,
 }
 
 
+/* push the number of option 'opt' (Kint, Kuint, or Kfloat) at 'str' */
+static void unpacknumber (lua_State *L, Header *h, KOption opt,
+                          const char *str, int size) {
+  if (opt == Kfloat) {
+    volatile Ftypes u;
+    lua_Number num;
+    copywithendian(u.buff, str, size, h->islittle);
+    if (size == sizeof(u.f)) num = (lua_Number)u.f;
+    else if (size == sizeof(u.d)) num = (lua_Number)u.d;
+    else num = u.n;
+    lua_pushnumber(L, num);
+  }
+  else
+    lua_pushinteger(L, unpackint(L, str, h->islittle, size, (opt == Kint)));
+}
+
+
+/* push a table with the 'count' numbers of option 'opt' at 'str' */
+static void unpackarray (lua_State *L, Header *h, KOption opt,
+                         const char *str, int size, int count) {
+  int i;
+  lua_createtable(L, count, 0);
+  for (i = 1; i <= count; i++) {
+    unpacknumber(L, h, opt, str, size);
+    lua_rawseti(L, -2, i);
+    str += size;
+  }
+}
+
+
 static int str_unpack (lua_State *L) {
   Header h;
   const char *fmt = luaL_checkstring(L, 1);
@@ -1485,6 +2459,18 @@ static int str_unpack (lua_State *L) {
   while (*fmt != '\0') {
     int size, ntoalign;
     KOption opt = getdetails(&h, pos, &fmt, &size, &ntoalign);
+    int count = getcount(&h, &fmt, opt, size);
+    if (count >= 0) {  /* repeated option? */
+      luaL_argcheck(L, (size_t)ntoalign <= ld - pos &&
+                       (size_t)count <= (ld - pos - ntoalign) / size,
+                       2, "data string too short");
+      pos += ntoalign;  /* skip alignment */
+      luaL_checkstack(L, 2, "too many results");
+      n++;
+      unpackarray(L, &h, opt, data + pos, size, count);
+      pos += (size_t)size * count;
+      continue;
+    }
     if ((size_t)ntoalign + size > ~pos || pos + ntoalign + size > ld)
       luaL_argerror(L, 2, "data string too short");
     pos += ntoalign;  /* skip alignment */
@@ -1492,21 +2478,8 @@ static int str_unpack (lua_State *L) {
     luaL_checkstack(L, 2, "too many results");
     n++;
     switch (opt) {
-      case Kint:
-      case Kuint: {
-        lua_Integer res = unpackint(L, data + pos, h.islittle, size,
-                                       (opt == Kint));
-        lua_pushinteger(L, res);
-        break;
-      }
-      case Kfloat: {
-        volatile Ftypes u;
-        lua_Number num;
-        copywithendian(u.buff, data + pos, size, h.islittle);
-        if (size == sizeof(u.f)) num = (lua_Number)u.f;
-        else if (size == sizeof(u.d)) num = (lua_Number)u.d;
-        else num = u.n;
-        lua_pushnumber(L, num);
+      case Kint: case Kuint: case Kfloat: {
+        unpacknumber(L, &h, opt, data + pos, size);
         break;
       }
       case Kchar: {
@@ -1577,7 +2550,10 @@ static void createmetatable (lua_State *L) {
 ** Open string library
 */
 LUAMOD_API int luaopen_string (lua_State *L) {
-  luaL_newlib(L, strlib);
+  luaL_newlibtable(L, strlib);
+  newpatcache(L, PATCACHESIZE);  /* caches shared by all functions */
+  newpatcache(L, FMTCACHESIZE);
+  luaL_setfuncs(L, strlib, 2);
   createmetatable(L);
   return 1;
 }
@@ -21,10 +21,12 @@
 ** in its main position (i.e. the 'original' position that its hash gives
 ** to it), then the colliding element is in its own main position.
 ** Hence even when the load factor reaches 100%, performance remains good.
+** Large hash parts grow incrementally (see 'Incremental rehash' below).
 */
 
 #include <math.h>
 #include <limits.h>
+#include <string.h>
 
 #include "lua.h"
 
@@ -55,21 +57,27 @@
 #define MAXHBITS	(MAXABITS - 1)
 
 
-#define hashpow2(t,n)		(gnode(t, lmod((n), sizenode(t))))
+/*
+** Number of old nodes moved to the new hash part at each insertion
+** into a table being rehashed incrementally
+*/
+#define REHASHSTEP	4
 
-#define hashstr(t,str)		hashpow2(t, (str)->hash)
-#define hashboolean(t,p)	hashpow2(t, p)
-#define hashint(t,i)		hashpow2(t, i)
 
+/* node for hash 'n' in array 'nd' with 'sz' (a power of 2) nodes */
+#define nodepow2(nd,sz,n)	(&(nd)[lmod((n), (sz))])
 
 /*
 ** for some types, it is better to avoid modulus by power of 2, as
 ** they tend to have many 2 factors.
 */
-#define hashmod(t,n)	(gnode(t, ((n) % ((sizenode(t)-1)|1))))
+#define nodemod(nd,sz,n)	(&(nd)[(n) % (((sz)-1)|1)])
 
 
-#define hashpointer(t,p)	hashmod(t, point2uint(p))
+#define hashpow2(t,n)		nodepow2((t)->node, sizenode(t), n)
+
+#define hashstr(t,str)		hashpow2(t, (str)->hash)
+#define hashint(t,i)		hashpow2(t, i)
 
 
 #define dummynode		(&dummynode_)
@@ -111,32 +119,35 @@ static int l_hashfloat (lua_Number n) {
 
 
 /*
-** returns the 'main' position of an element in a table (that is, the index
-** of its hash value)
+** returns the 'main' position of an element in a node array 'nd' with
+** 'sz' nodes (that is, the index of its hash value)
 */
-static Node *mainposition (const Table *t, const TValue *key) {
+static Node *nodeposition (Node *nd, int sz, const TValue *key) {
   switch (ttype(key)) {
     case LUA_TNUMINT:
-      return hashint(t, ivalue(key));
+      return nodepow2(nd, sz, ivalue(key));
     case LUA_TNUMFLT:
-      return hashmod(t, l_hashfloat(fltvalue(key)));
+      return nodemod(nd, sz, l_hashfloat(fltvalue(key)));
     case LUA_TSHRSTR:
-      return hashstr(t, tsvalue(key));
+      return nodepow2(nd, sz, tsvalue(key)->hash);
     case LUA_TLNGSTR:
-      return hashpow2(t, luaS_hashlongstr(tsvalue(key)));
+      return nodepow2(nd, sz, luaS_hashlongstr(tsvalue(key)));
     case LUA_TBOOLEAN:
-      return hashboolean(t, bvalue(key));
+      return nodepow2(nd, sz, bvalue(key));
     case LUA_TLIGHTUSERDATA:
-      return hashpointer(t, pvalue(key));
+      return nodemod(nd, sz, point2uint(pvalue(key)));
     case LUA_TLCF:
-      return hashpointer(t, fvalue(key));
+      return nodemod(nd, sz, point2uint(fvalue(key)));
     default:
       lua_assert(!ttisdeadkey(key));
-      return hashpointer(t, gcvalue(key));
+      return nodemod(nd, sz, point2uint(gcvalue(key)));
   }
 }
 
 
+#define mainposition(t,key)	nodeposition((t)->node, sizenode(t), key)
+
+
 /*
 ** returns the index for 'key' if 'key' is an appropriate key to live in
 ** the array part of the table, 0 otherwise.
@@ -151,10 +162,47 @@ static unsigned int arrayindex (const TValue *key) {
 }
 
 
+/*
+** search for 'key' in the old hash part of table 't', if there is one
+** (see 'Incremental rehash'). When 'deadok' is true, a dead key also
+** matches the collectable object it was. Returns NULL if not found.
+*/
+static Node *findold (const Table *t, const TValue *key, int deadok) {
+  const OldNodes *old = t->old;
+  Node *n;
+  if (old == NULL || old->size == 0)
+    return NULL;
+  n = nodeposition(old->node, old->size, key);
+  for (;;) {  /* check whether 'key' is somewhere in the chain */
+    if (luaV_rawequalobj(gkey(n), key) ||
+          (deadok && ttisdeadkey(gkey(n)) && iscollectable(key) &&
+           deadvalue(gkey(n)) == gcvalue(key)))
+      return n;
+    else {
+      int nx = gnext(n);
+      if (nx == 0)
+        return NULL;  /* not found */
+      n += nx;
+    }
+  }
+}
+
+
+/*
+** search function for the old hash part; entries already moved to the
+** new part (or removed) have nil values there.
+*/
+static const TValue *getold (const Table *t, const TValue *key) {
+  Node *n = findold(t, key, 0);
+  return (n == NULL || ttisnil(gval(n))) ? luaO_nilobject : gval(n);
+}
+
+
 /*
 ** returns the index of a 'key' for table traversals. First goes all
-** elements in the array part, then elements in the hash part. The
-** beginning of a traversal is signaled by 0.
+** elements in the array part, then elements in the hash part, then
+** elements in the old hash part (if any). The beginning of a traversal
+** is signaled by 0.
 */
 static unsigned int findindex (lua_State *L, Table *t, StkId key) {
   unsigned int i;
@@ -175,10 +223,15 @@ static unsigned int findindex (lua_State *L, Table *t, StkId key) {
         return (i + 1) + t->sizearray;
       }
       nx = gnext(n);
-      if (nx == 0)
-        luaG_runerror(L, "invalid key to 'next'");  /* key not found */
-      else n += nx;
+      if (nx == 0) break;
+      n += nx;
     }
+    n = findold(t, key, 1);
+    if (n == NULL)
+      luaG_runerror(L, "invalid key to 'next'");  /* key not found */
+    i = cast_int(n - t->old->node);  /* key index in old hash table */
+    /* old hash elements are numbered after new ones */
+    return (i + 1) + t->sizearray + sizenode(t);
   }
 }
 
@@ -199,6 +252,14 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
       return 1;
     }
   }
+  for (i -= sizenode(t); cast_int(i) < oldsizenode(t); i++) {  /* old part */
+    Node *n = &t->old->node[i];
+    if (!ttisnil(gval(n))) {  /* a non-nil value? */
+      setobj2s(L, key, gkey(n));
+      setobj2s(L, key+1, gval(n));
+      return 1;
+    }
+  }
   return 0;  /* no more elements */
 }
 
@@ -330,13 +391,91 @@ static void setnodevector (lua_State *L, Table *t, unsigned int size) {
 }
 
 
+static TValue *insertkey (lua_State *L, Table *t, const TValue *key);
+
+
+/*
+** {=============================================================
+** Incremental rehash
+** When the hash part of a large table (at least 2^TABINCRBITS nodes)
+** is full and the array part would keep its size, the table does not
+** reinsert all its entries at once: it gets a new hash part and keeps
+** the old one in 't->old'. Each insertion of a new key then moves a
+** few old nodes ('old->step') to the new part, so that the old part
+** is empty before the new one fills up. Meanwhile, searches that fail
+** in the new part continue in the old one (where moved or removed
+** entries have nil values), and traversals go through the old nodes
+** after the new ones. (As a traversal cannot insert new keys, no entry
+** moves while it runs.) A live key is never in both parts.
+** ==============================================================
+*/
+
+/*
+** Move up to 'n' nodes from the old hash part of table 't' to the new
+** one, and free the old part when all its nodes were moved. (No barrier
+** needed, as all entries were already present in the table.)
+*/
+static void rehashstep (lua_State *L, Table *t, int n) {
+  OldNodes *old = t->old;
+  for (; n > 0 && old->cursor < old->size; n--) {
+    Node *o = &old->node[old->cursor++];
+    if (!ttisnil(gval(o))) {
+      TValue *cell = insertkey(L, t, gkey(o));
+      lua_assert(cell != NULL);  /* 'step' ensures there is a free place */
+      setobjt2t(L, cell, gval(o));
+      setnilvalue(gval(o));
+    }
+  }
+  if (old->cursor == old->size) {  /* old part is empty? */
+    if (old->size > 0)
+      luaM_freearray(L, old->node, cast(size_t, old->size));
+    luaM_free(L, old);
+    t->old = NULL;
+  }
+}
+
+
+#define finishrehash(L,t)	rehashstep(L, t, MAX_INT)
+
+
+/*
+** Start an incremental rehash of table 't', giving it a new hash part
+** with room for 'nhsize' elements; 'nuse' is the number of elements in
+** the current hash part. The step is computed so that, even if all new
+** keys go to the new part, it does not fill up before receiving all
+** old entries.
+*/
+static void startrehash (lua_State *L, Table *t, unsigned int nhsize,
+                                                 int nuse) {
+  OldNodes *old = luaM_new(L, OldNodes);
+  Node *nold = t->node;
+  int oldsize = sizenode(t);
+  old->node = NULL;  /* if 'setnodevector' fails, there is no old part */
+  old->size = old->cursor = 0;
+  old->step = 1;
+  t->old = old;
+  setnodevector(L, t, nhsize);
+  lua_assert(nuse < sizenode(t));
+  old->node = nold;
+  old->size = oldsize;
+  old->step = oldsize / (sizenode(t) - nuse) + 1;
+}
+
+/* }============================================================= */
+
+
 void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
                                           unsigned int nhsize) {
   unsigned int i;
   int j;
-  unsigned int oldasize = t->sizearray;
-  int oldhsize = allocsizenode(t);
-  Node *nold = t->node;  /* save old hash ... */
+  unsigned int oldasize;
+  int oldhsize;
+  Node *nold;
+  if (t->old != NULL)  /* incremental rehash in progress? */
+    finishrehash(L, t);  /* move all entries to current hash part */
+  oldasize = t->sizearray;
+  oldhsize = allocsizenode(t);
+  nold = t->node;  /* save old hash ... */
   if (nasize > oldasize)  /* array part must grow? */
     setarrayvector(L, t, nasize);
   /* create new hash part with appropriate size */
@@ -379,17 +518,23 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
   unsigned int nums[MAXABITS + 1];
   int i;
   int totaluse;
+  int hashuse;  /* number of keys in hash part */
+  if (t->old != NULL)  /* previous incremental rehash not finished? */
+    finishrehash(L, t);
   for (i = 0; i <= MAXABITS; i++) nums[i] = 0;  /* reset counts */
   na = numusearray(t, nums);  /* count keys in array part */
   totaluse = na;  /* all those keys are integer keys */
-  totaluse += numusehash(t, nums, &na);  /* count keys in hash part */
+  hashuse = numusehash(t, nums, &na);  /* count keys in hash part */
+  totaluse += hashuse;
   /* count extra key */
   na += countint(ek, nums);
   totaluse++;
   /* compute new size for array part */
   asize = computesizes(nums, &na);
-  /* resize the table to new computed sizes */
-  luaH_resize(L, t, asize, totaluse - na);
+  if (asize == t->sizearray && t->lsizenode >= TABINCRBITS)
+    startrehash(L, t, totaluse - na, hashuse);  /* only hash part changes */
+  else  /* resize the table to new computed sizes */
+    luaH_resize(L, t, asize, totaluse - na);
 }
 
 
@@ -406,6 +551,8 @@ Table *luaH_new (lua_State *L) {
   t->flags = cast_byte(~0);
   t->array = NULL;
   t->sizearray = 0;
+  t->lenhint = 0;
+  t->old = NULL;
   setnodevector(L, t, 0);
   return t;
 }
@@ -414,8 +561,49 @@ Table *luaH_new (lua_State *L) {
 void luaH_free (lua_State *L, Table *t) {
   if (!isdummy(t))
     luaM_freearray(L, t->node, cast(size_t, sizenode(t)));
+  if (t->old != NULL) {  /* incremental rehash in progress? */
+    if (t->old->size > 0)
+      luaM_freearray(L, t->old->node, cast(size_t, t->old->size));
+    luaM_free(L, t->old);
+  }
   luaM_freearray(L, t->array, t->sizearray);
-  luaM_free(L, t);
+  luaC_freegco(L, obj2gco(t), sizeof(Table));
+}
+
+
+/*
+** Make 'c', a new and empty table, a raw copy of table 't' (without its
+** metatable). Both parts are copied wholesale: node positions depend
+** only on the size of the hash part and 'gnext' holds relative offsets.
+** Entries still in the old part of an incremental rehash are inserted
+** one by one. (No barriers needed, as 'c' is new and therefore white.)
+*/
+void luaH_copy (lua_State *L, Table *c, Table *t) {
+  unsigned int asize = t->sizearray;
+  int hsize = allocsizenode(t);
+  lua_assert(c->sizearray == 0 && isdummy(c));
+  c->lenhint = t->lenhint;
+  if (asize > 0) {
+    TValue *array = luaM_newvector(L, asize, TValue);
+    memcpy(array, t->array, asize * sizeof(TValue));
+    c->array = array;
+    c->sizearray = asize;
+  }
+  if (hsize > 0) {
+    Node *node = luaM_newvector(L, hsize, Node);
+    memcpy(node, t->node, hsize * sizeof(Node));
+    c->node = node;
+    c->lsizenode = t->lsizenode;
+    c->lastfree = node + (t->lastfree - t->node);
+  }
+  if (t->old != NULL) {  /* incremental rehash in progress? */
+    int i;
+    for (i = t->old->cursor; i < t->old->size; i++) {
+      Node *o = &t->old->node[i];
+      if (!ttisnil(gval(o)))
+        setobjt2t(L, luaH_set(L, c, gkey(o)), gval(o));
+    }
+  }
 }
 
 
@@ -437,30 +625,16 @@ static Node *getfreepos (Table *t) {
 ** position is free. If not, check whether colliding node is in its main
 ** position or not: if it is not, move colliding node to an empty place and
 ** put new key in its main position; otherwise (colliding node is in its main
-** position), new key goes to an empty position.
+** position), new key goes to an empty position. Returns NULL if there is
+** no free place for the key.
 */
-TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
-  Node *mp;
-  TValue aux;
-  if (ttisnil(key)) luaG_runerror(L, "table index is nil");
-  else if (ttisfloat(key)) {
-    lua_Integer k;
-    if (luaV_tointeger(key, &k, 0)) {  /* does index fit in an integer? */
-      setivalue(&aux, k);
-      key = &aux;  /* insert it as an integer */
-    }
-    else if (luai_numisnan(fltvalue(key)))
-      luaG_runerror(L, "table index is NaN");
-  }
-  mp = mainposition(t, key);
+static TValue *insertkey (lua_State *L, Table *t, const TValue *key) {
+  Node *mp = mainposition(t, key);
   if (!ttisnil(gval(mp)) || isdummy(t)) {  /* main position is taken? */
     Node *othern;
     Node *f = getfreepos(t);  /* get a free place */
-    if (f == NULL) {  /* cannot find a free place? */
-      rehash(L, t, key);  /* grow table */
-      /* whatever called 'newkey' takes care of TM cache */
-      return luaH_set(L, t, key);  /* insert key into grown table */
-    }
+    if (f == NULL)  /* cannot find a free place? */
+      return NULL;
     lua_assert(!isdummy(t));
     othern = mainposition(t, gkey(mp));
     if (othern != mp) {  /* is colliding node out of its main position? */
@@ -485,12 +659,37 @@ TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
     }
   }
   setnodekey(L, &mp->i_key, key);
-  luaC_barrierback(L, t, key);
   lua_assert(ttisnil(gval(mp)));
   return gval(mp);
 }
 
 
+TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
+  TValue *cell;
+  TValue aux;
+  if (ttisnil(key)) luaG_runerror(L, "table index is nil");
+  else if (ttisfloat(key)) {
+    lua_Integer k;
+    if (luaV_tointegerns(key, &k, 0)) {  /* does index fit in an integer? */
+      setivalue(&aux, k);
+      key = &aux;  /* insert it as an integer */
+    }
+    else if (luai_numisnan(fltvalue(key)))
+      luaG_runerror(L, "table index is NaN");
+  }
+  if (t->old != NULL)  /* incremental rehash in progress? */
+    rehashstep(L, t, t->old->step);
+  cell = insertkey(L, t, key);
+  if (cell == NULL) {  /* cannot find a free place? */
+    rehash(L, t, key);  /* grow table */
+    /* whatever called 'newkey' takes care of TM cache */
+    return luaH_set(L, t, key);  /* insert key into grown table */
+  }
+  luaC_barrierback(L, t, key);
+  return cell;
+}
+
+
 /*
 ** search function for integers
 */
@@ -509,6 +708,11 @@ const TValue *luaH_getint (Table *t, lua_Integer key) {
         n += nx;
       }
     }
+    if (t->old != NULL) {  /* incremental rehash in progress? */
+      TValue k;
+      setivalue(&k, key);
+      return getold(t, &k);
+    }
     return luaO_nilobject;
   }
 }
@@ -526,11 +730,16 @@ const TValue *luaH_getshortstr (Table *t, TString *key) {
       return gval(n);  /* that's it */
     else {
       int nx = gnext(n);
-      if (nx == 0)
-        return luaO_nilobject;  /* not found */
+      if (nx == 0) break;
       n += nx;
     }
   }
+  if (t->old != NULL) {  /* incremental rehash in progress? */
+    TValue ko;
+    setsvalue(cast(lua_State *, NULL), &ko, key);
+    return getold(t, &ko);
+  }
+  return luaO_nilobject;  /* not found */
 }
 
 
@@ -546,7 +755,7 @@ static const TValue *getgeneric (Table *t, const TValue *key) {
     else {
       int nx = gnext(n);
       if (nx == 0)
-        return luaO_nilobject;  /* not found */
+        return (t->old == NULL) ? luaO_nilobject : getold(t, key);
       n += nx;
     }
   }
@@ -574,7 +783,7 @@ const TValue *luaH_get (Table *t, const TValue *key) {
     case LUA_TNIL: return luaO_nilobject;
     case LUA_TNUMFLT: {
       lua_Integer k;
-      if (luaV_tointeger(key, &k, 0)) /* index is int? */
+      if (luaV_tointegerns(key, &k, 0)) /* index is int? */
         return luaH_getint(t, k);  /* use specialized version */
       /* else... */
     }  /* FALLTHROUGH */
@@ -638,7 +847,7 @@ static int unbound_search (Table *t, unsigned int j) {
 ** Try to find a boundary in table 't'. A 'boundary' is an integer index
 ** such that t[i] is non-nil and t[i+1] is nil (and 0 if t[1] is nil).
 */
-int luaH_getn (Table *t) {
+static int findboundary (Table *t) {
   unsigned int j = t->sizearray;
   if (j > 0 && ttisnil(&t->array[j - 1])) {
     /* there is a boundary in the array part: (binary) search for it */
@@ -657,6 +866,335 @@ int luaH_getn (Table *t) {
 }
 
 
+/* 'j' is a boundary of table 't' */
+#define isboundary(t,j)  \
+	(((j) == 0 || !ttisnil(luaH_getint(t, j))) && \
+	 ttisnil(luaH_getint(t, (j) + 1)))
+
+
+/*
+** Length of table 't'. The last boundary found is kept in 't->lenhint':
+** as sequences usually grow or shrink at their ends, checking the hint
+** and its neighbors gives the length in constant time for them. (The
+** hint is only a guess, always checked, so table updates can ignore it.)
+*/
+int luaH_getn (Table *t) {
+  lua_Integer j = t->lenhint;
+  int n;
+  if (isboundary(t, j))
+    return cast_int(j);
+  else if (j < MAX_INT && isboundary(t, j + 1))  /* an element added? */
+    n = cast_int(j + 1);
+  else if (j > 0 && isboundary(t, j - 1))  /* an element removed? */
+    n = cast_int(j - 1);
+  else
+    n = findboundary(t);
+  t->lenhint = cast(unsigned int, n);
+  return n;
+}
+
+
+/*
+** Raw copy of entries t1[f..e] into t2[t..t+e-f], all of which must be
+** in the array parts of the tables (the ranges may overlap); returns 0,
+** doing nothing, otherwise.
+*/
+int luaH_movearray (lua_State *L, Table *t1, lua_Integer f, lua_Integer e,
+                                  Table *t2, lua_Integer t) {
+  lua_Unsigned n;  /* number of entries minus 1 */
+  if (!(1 <= f && f <= e && l_castS2U(e) <= t1->sizearray))
+    return 0;
+  n = l_castS2U(e - f);
+  if (!(t >= 1 && n < t2->sizearray && l_castS2U(t) <= t2->sizearray - n))
+    return 0;
+  memmove(&t2->array[t - 1], &t1->array[f - 1],
+          cast(size_t, n + 1) * sizeof(TValue));
+  if (isblack(t2))  /* may now refer to white objects? */
+    luaC_barrierback_(L, t2);
+  return 1;
+}
+
+
+
+/*
+** {======================================================
+** Native sort of the array part
+** ('luaH_sortarray' sorts the first 'n' entries of the array part
+** when they are all numbers or all strings, moving the TValues in
+** place.  It is a pattern-defeating quicksort: median-of-3 or ninther
+** pivots, insertion sort for small ranges, partial insertion sort for
+** ranges that came out already partitioned, elements equal to the
+** pivot grouped in one pass, and heapsort when partitions keep
+** being unbalanced.)
+** =======================================================
+*/
+
+/* ranges smaller than this are sorted by insertion */
+#if !defined(SORTINSERTION)
+#define SORTINSERTION	24
+#endif
+
+/* ranges larger than this use the ninther as pivot */
+#if !defined(SORTNINTHER)
+#define SORTNINTHER	128
+#endif
+
+/* maximum moves done by a partial insertion sort */
+#define SORTPARTIAL	8
+
+
+typedef int (*SortLT) (lua_State *L, const TValue *a, const TValue *b);
+
+typedef struct SortState {
+  lua_State *L;
+  SortLT lt;
+} SortState;
+
+#define sortlt(S,a,b)	((S)->lt((S)->L, a, b))
+
+
+static int ltint (lua_State *L, const TValue *a, const TValue *b) {
+  UNUSED(L);
+  return ivalue(a) < ivalue(b);
+}
+
+
+static int ltflt (lua_State *L, const TValue *a, const TValue *b) {
+  UNUSED(L);
+  return luai_numlt(fltvalue(a), fltvalue(b));
+}
+
+
+static void swapobj (lua_State *L, TValue *a, TValue *b) {
+  TValue temp;
+  setobj(L, &temp, a);
+  setobj(L, a, b);
+  setobj(L, b, &temp);
+}
+
+
+/* sort 'a', 'b', and 'c' so that *a <= *b <= *c */
+static void sort3 (SortState *S, TValue *a, TValue *b, TValue *c) {
+  if (sortlt(S, b, a)) swapobj(S->L, a, b);
+  if (sortlt(S, c, b)) {
+    swapobj(S->L, b, c);
+    if (sortlt(S, b, a)) swapobj(S->L, a, b);
+  }
+}
+
+
+/*
+** Insertion sort of [first, last). With 'limit' > 0, gives up (returning
+** 0) after moving more than 'limit' elements.
+*/
+static int insertsort (SortState *S, TValue *first, TValue *last,
+                       size_t limit) {
+  size_t moves = 0;
+  TValue *i;
+  for (i = first + 1; i < last; i++) {
+    if (sortlt(S, i, i - 1)) {
+      TValue temp;
+      TValue *j = i;
+      setobj(S->L, &temp, i);
+      do {
+        setobj(S->L, j, j - 1);
+        j--;
+      } while (j > first && sortlt(S, &temp, j - 1));
+      setobj(S->L, j, &temp);
+      moves += cast(size_t, i - j);
+      if (limit > 0 && moves > limit) return 0;
+    }
+  }
+  return 1;
+}
+
+
+static void siftdown (SortState *S, TValue *a, size_t i, size_t n) {
+  for (;;) {
+    size_t c = 2 * i + 1;
+    if (c >= n) break;
+    if (c + 1 < n && sortlt(S, &a[c], &a[c + 1])) c++;
+    if (!sortlt(S, &a[i], &a[c])) break;
+    swapobj(S->L, &a[i], &a[c]);
+    i = c;
+  }
+}
+
+
+static void heapsort (SortState *S, TValue *first, TValue *last) {
+  size_t n = cast(size_t, last - first);
+  size_t i = n / 2;
+  while (i-- > 0)
+    siftdown(S, first, i, n);
+  while (n-- > 1) {
+    swapobj(S->L, first, first + n);
+    siftdown(S, first, 0, n);
+  }
+}
+
+
+/*
+** Partition [first, last) around the pivot in '*first', leaving elements
+** equal to the pivot on its right; returns the final pivot position.
+** The range must contain an element not less than the pivot after it
+** (ensured by the pivot selection). '*done' tells whether no element
+** was out of place.
+*/
+static TValue *partright (SortState *S, TValue *first, TValue *last,
+                          int *done) {
+  TValue pivot;
+  TValue *l = first;
+  TValue *r = last;
+  setobj(S->L, &pivot, first);
+  while (sortlt(S, ++l, &pivot)) ;
+  if (l - 1 == first)  /* no element less than pivot to stop 'r'? */
+    while (l < r && !sortlt(S, --r, &pivot)) ;
+  else
+    while (!sortlt(S, --r, &pivot)) ;
+  *done = (l >= r);
+  while (l < r) {
+    swapobj(S->L, l, r);
+    while (sortlt(S, ++l, &pivot)) ;
+    while (!sortlt(S, --r, &pivot)) ;
+  }
+  l--;
+  setobj(S->L, first, l);
+  setobj(S->L, l, &pivot);
+  return l;
+}
+
+
+/*
+** Partition [first, last) around the pivot in '*first' putting elements
+** equal to it on its left. Used when the pivot equals the element just
+** before the range, so that all of them are already in place.
+*/
+static TValue *partleft (SortState *S, TValue *first, TValue *last) {
+  TValue pivot;
+  TValue *l = first;
+  TValue *r = last;
+  setobj(S->L, &pivot, first);
+  while (sortlt(S, &pivot, --r)) ;
+  if (r + 1 == last)
+    while (l < r && !sortlt(S, &pivot, ++l)) ;
+  else
+    while (!sortlt(S, &pivot, ++l)) ;
+  while (l < r) {
+    swapobj(S->L, l, r);
+    while (sortlt(S, &pivot, --r)) ;
+    while (!sortlt(S, &pivot, ++l)) ;
+  }
+  setobj(S->L, first, r);
+  setobj(S->L, r, &pivot);
+  return r;
+}
+
+
+static void pdqsort (SortState *S, TValue *first, TValue *last, int bad,
+                     int leftmost) {
+  for (;;) {
+    size_t size = cast(size_t, last - first);
+    TValue *mid = first + size / 2;
+    TValue *p;
+    size_t ls, rs;
+    int done;
+    if (size < SORTINSERTION) {
+      insertsort(S, first, last, 0);
+      return;
+    }
+    if (size > SORTNINTHER) {  /* median of the medians of 3 triples */
+      sort3(S, first, mid, last - 1);
+      sort3(S, first + 1, mid - 1, last - 2);
+      sort3(S, first + 2, mid + 1, last - 3);
+      sort3(S, mid - 1, mid, mid + 1);
+      swapobj(S->L, first, mid);
+    }
+    else  /* median of 3, moved to 'first' */
+      sort3(S, mid, first, last - 1);
+    if (!leftmost && !sortlt(S, first - 1, first)) {
+      /* pivot equals previous element: skip all elements equal to it */
+      first = partleft(S, first, last) + 1;
+      continue;
+    }
+    p = partright(S, first, last, &done);
+    ls = cast(size_t, p - first);
+    rs = cast(size_t, last - (p + 1));
+    if (ls < size / 8 || rs < size / 8) {  /* unbalanced partition? */
+      if (--bad == 0) {  /* too many of them? */
+        heapsort(S, first, last);
+        return;
+      }
+      /* break possible patterns for next partitions */
+      if (ls >= SORTINSERTION) {
+        swapobj(S->L, first, first + ls / 4);
+        swapobj(S->L, p - 1, p - ls / 4);
+      }
+      if (rs >= SORTINSERTION) {
+        swapobj(S->L, p + 1, p + 1 + rs / 4);
+        swapobj(S->L, last - 1, last - rs / 4);
+      }
+    }
+    else if (done && insertsort(S, first, p, SORTPARTIAL) &&
+                     insertsort(S, p + 1, last, SORTPARTIAL))
+      return;  /* range was (nearly) sorted already */
+    /* recurse into the smaller half; loop over the larger one */
+    if (ls < rs) {
+      pdqsort(S, first, p, bad, leftmost);
+      first = p + 1;
+      leftmost = 0;
+    }
+    else {
+      pdqsort(S, p + 1, last, bad, 0);
+      last = p;
+    }
+  }
+}
+
+
+/*
+** Sort entries 1..n of table 't' (all in its array part) in ascending
+** order, if they are all numbers (none a NaN) or all strings. Returns 0
+** without changing the table otherwise. Moving values inside the array
+** part needs no barrier. Comparing a string view would detach it, which
+** may raise a memory error in the middle of the sort; so, views are
+** detached up front, while no element has been moved yet. After that,
+** comparisons cannot raise errors.
+*/
+int luaH_sortarray (lua_State *L, Table *t, lua_Integer n) {
+  SortState S;
+  TValue *a = t->array;
+  int kinds = 0;  /* 1: integers; 2: floats; 4: strings */
+  lua_Integer i;
+  if (n < 0 || l_castS2U(n) > t->sizearray)
+    return 0;  /* not all in the array part */
+  for (i = 0; i < n; i++) {
+    const TValue *o = &a[i];
+    if (ttisinteger(o)) kinds |= 1;
+    else if (ttisfloat(o) && !luai_numisnan(fltvalue(o))) kinds |= 2;
+    else if (ttisstring(o)) {
+      kinds |= 4;
+      if (ttislngstring(o) && isstrview(tsvalue(o)))
+        luaS_detach(L, tsvalue(o));  /* 'l_strcmp' would allocate */
+    }
+    else return 0;  /* nil, NaN, or value needing metamethods */
+  }
+  switch (kinds) {
+    case 0: return 1;  /* empty range */
+    case 1: S.lt = ltint; break;
+    case 2: S.lt = ltflt; break;
+    case 3: case 4: S.lt = luaV_lessthan; break;  /* no metamethods */
+    default: return 0;  /* numbers mixed with strings */
+  }
+  S.L = L;
+  i = 2;
+  while (n >> i) i++;  /* i ~ log2(n) */
+  pdqsort(&S, a, a + n, cast_int(i), 1);
+  return 1;
+}
+
+/* }====================================================== */
+
+
 
 #if defined(LUA_DEBUG)
 
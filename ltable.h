@@ -35,6 +35,18 @@
 #define allocsizenode(t)	(isdummy(t) ? 0 : sizenode(t))
 
 
+/*
+** tables whose hash part has at least 2^TABINCRBITS nodes grow
+** incrementally
+*/
+#if !defined(TABINCRBITS)
+#define TABINCRBITS	16
+#endif
+
+/* number of old nodes (including the empty ones) in a table being rehashed */
+#define oldsizenode(t)	((t)->old == NULL ? 0 : (t)->old->size)
+
+
 /* returns the key, given the value of a table entry */
 #define keyfromval(v) \
   (gkey(cast(Node *, cast(char *, (v)) - offsetof(Node, i_val))))
@@ -53,8 +65,12 @@ LUAI_FUNC void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
                                                     unsigned int nhsize);
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
+LUAI_FUNC void luaH_copy (lua_State *L, Table *c, Table *t);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
 LUAI_FUNC int luaH_getn (Table *t);
+LUAI_FUNC int luaH_movearray (lua_State *L, Table *t1, lua_Integer f,
+                              lua_Integer e, Table *t2, lua_Integer t);
+LUAI_FUNC int luaH_sortarray (lua_State *L, Table *t, lua_Integer n);
 
 
 #if defined(LUA_DEBUG)
@@ -32,6 +32,9 @@
 
 #define aux_getn(L,n,w)	(checktab(L, n, (w) | TAB_L), luaL_len(L, n))
 
+/* 'lua_getarray' and 'lua_movearray' only work on real tables */
+#define istable(L,n)	(lua_type(L, n) == LUA_TTABLE)
+
 
 static int checkfield (lua_State *L, const char *key, int n) {
   lua_pushstring(L, key);
@@ -139,7 +142,10 @@ static int tmove (lua_State *L) {
     n = e - f + 1;  /* number of elements to move */
     luaL_argcheck(L, t <= LUA_MAXINTEGER - n + 1, 4,
                   "destination wrap around");
-    if (t > e || t <= f || (tt != 1 && !lua_compare(L, 1, tt, LUA_OPEQ))) {
+    if (istable(L, 1) && istable(L, tt) && lua_movearray(L, 1, f, e, t, tt))
+      ;  /* moved with raw copies */
+    else if (t > e || t <= f ||
+             (tt != 1 && !lua_compare(L, 1, tt, LUA_OPEQ))) {
       for (i = 0; i < n; i++) {
         lua_geti(L, 1, f + i);
         lua_seti(L, tt, t + i);
@@ -157,15 +163,136 @@ static int tmove (lua_State *L) {
 }
 
 
+static int tclone (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_clonetable(L, 1);
+  return 1;
+}
+
+
+/*
+** Assign 'v' to list[i], ..., list[j]. After the first assignment, the
+** filled range is doubled with raw copies while it is in the array part.
+*/
+static int tfill (lua_State *L) {
+  lua_Integer i, e;
+  checktab(L, 1, TAB_RW);
+  luaL_checkany(L, 2);
+  i = luaL_optinteger(L, 3, 1);
+  e = luaL_opt(L, luaL_checkinteger, 4, luaL_len(L, 1));
+  lua_settop(L, 2);
+  if (i <= e) {  /* otherwise, nothing to fill */
+    lua_Integer n, done;
+    luaL_argcheck(L, i > 0 || e < LUA_MAXINTEGER + i, 4,
+                  "too many elements to fill");
+    n = e - i + 1;  /* number of elements to fill */
+    lua_pushvalue(L, 2);
+    lua_seti(L, 1, i);
+    done = 1;
+    if (istable(L, 1)) {
+      while (done < n) {
+        lua_Integer k = (done < n - done) ? done : n - done;
+        if (!lua_movearray(L, 1, i, i + k - 1, i + done, 1))
+          break;  /* not in the array part */
+        done += k;
+      }
+    }
+    for (; done < n; done++) {
+      lua_pushvalue(L, 2);
+      lua_seti(L, 1, i + done);
+    }
+  }
+  lua_settop(L, 1);
+  return 1;  /* return list */
+}
+
+
+/*
+** Return a new list with list[i], ..., list[j]. The new list is created
+** with room only for the part of the range up to the border of 'list'
+** (when it is a table); it grows as usual beyond that.
+*/
+static int tslice (lua_State *L) {
+  lua_Integer i, e;
+  checktab(L, 1, TAB_R);
+  i = luaL_optinteger(L, 2, 1);
+  e = luaL_opt(L, luaL_checkinteger, 3, luaL_len(L, 1));
+  lua_settop(L, 3);
+  if (i > e) {  /* empty range? */
+    lua_newtable(L);
+    return 1;
+  }
+  else {
+    lua_Integer n, k, last = 0;
+    luaL_argcheck(L, i > 0 || e < LUA_MAXINTEGER + i, 3,
+                  "too many elements to slice");
+    n = e - i + 1;  /* number of elements */
+    luaL_argcheck(L, n < INT_MAX, 3, "too many elements to slice");
+    if (istable(L, 1)) {
+      lua_Integer border = (lua_Integer)lua_rawlen(L, 1);
+      last = (e < border) ? e : border;  /* last element up to the border */
+    }
+    lua_createtable(L, (i > 0 && last >= i) ? (int)(last - i + 1) : 0, 0);
+    if (!(istable(L, 1) && lua_movearray(L, 1, i, e, 1, 4))) {
+      for (k = 0; k < n; k++) {
+        lua_geti(L, 1, i + k);
+        lua_seti(L, 4, k + 1);
+      }
+    }
+    return 1;
+  }
+}
+
+
+static void checkvalue (lua_State *L, int idx, lua_Integer i) {
+  if (!lua_isstring(L, idx))
+    luaL_error(L, "invalid value (%s) at index %d in table for 'concat'",
+                  luaL_typename(L, idx), i);
+}
+
+
 static void addfield (lua_State *L, luaL_Buffer *b, lua_Integer i) {
   lua_geti(L, 1, i);
-  if (!lua_isstring(L, -1))
-    luaL_error(L, "invalid value (%s) at index %d in table for 'concat'",
-                  luaL_typename(L, -1), i);
+  checkvalue(L, -1, i);
   luaL_addvalue(b);
 }
 
 
+/* number of elements 'tconcat' gets at once from an array part */
+#define CONCATCHUNK	64
+
+
+/*
+** Add t[i..i+n-1], each followed by the separator, to buffer 'b', getting
+** them at once from the array part of 't' and joining them with a
+** single 'lua_concat'. Returns 0 if the elements are not available that
+** way, or if there is no memory for the stack space it needs (so that
+** 'tconcat' goes on one element at a time).
+*/
+static int addchunk (lua_State *L, luaL_Buffer *b, lua_Integer i, int n,
+                     int hassep) {
+  int base = lua_gettop(L);
+  int k;
+  if (!lua_checkstack(L, 3 * n) || !lua_getarray(L, 1, i, n))
+    return 0;
+  for (k = 1; k <= n; k++)
+    checkvalue(L, base + k, i + k - 1);
+  if (hassep) {  /* interleave elements and separators */
+    for (k = 1; k <= n; k++) {
+      lua_pushvalue(L, base + k);
+      lua_pushvalue(L, 2);
+    }
+    lua_concat(L, 2 * n);
+    lua_replace(L, base + 1);
+  }
+  else
+    lua_concat(L, n);
+  lua_settop(L, base + 1);
+  luaL_addvalue(b);
+  return 1;
+}
+
+
 static int tconcat (lua_State *L) {
   luaL_Buffer b;
   lua_Integer last = aux_getn(L, 1, TAB_R);
@@ -174,6 +301,11 @@ static int tconcat (lua_State *L) {
   lua_Integer i = luaL_optinteger(L, 3, 1);
   last = luaL_optinteger(L, 4, last);
   luaL_buffinit(L, &b);
+  if (istable(L, 1)) {  /* try to get elements from the array part */
+    while (i >= 1 && last - i >= CONCATCHUNK &&
+           addchunk(L, &b, i, CONCATCHUNK, lsep > 0))
+      i += CONCATCHUNK;
+  }
   for (; i < last; i++) {
     addfield(L, &b, i);
     luaL_addlstring(&b, sep, lsep);
@@ -212,6 +344,8 @@ static int unpack (lua_State *L) {
   n = (lua_Unsigned)e - i;  /* number of elements minus 1 (avoid overflows) */
   if (n >= (unsigned int)INT_MAX  || !lua_checkstack(L, (int)(++n)))
     return luaL_error(L, "too many results to unpack");
+  if (istable(L, 1) && lua_getarray(L, 1, i, (int)n))
+    return (int)n;  /* got all elements from the array part */
   for (; i < e; i++) {  /* push arg[i..e - 1] (to avoid overflows) */
     lua_geti(L, 1, i);
   }
@@ -415,7 +549,240 @@ static int sort (lua_State *L) {
     if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
       luaL_checktype(L, 2, LUA_TFUNCTION);  /* must be a function */
     lua_settop(L, 2);  /* make sure there are two arguments */
-    auxsort(L, 1, (IdxT)n, 0);
+    if (!(lua_isnil(L, 2) && lua_type(L, 1) == LUA_TTABLE &&
+          lua_sortarray(L, 1, n)))  /* no native sort? */
+      auxsort(L, 1, (IdxT)n, 0);
+  }
+  return 0;
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Stable sorts
+** ('stablesort' and 'sortby' sort an array of (key, position) entries
+** with a merge sort and only then move the values in the list, which
+** is left untouched if a comparison raises an error. 'sortby' calls
+** its key function once per element; number or string keys are then
+** compared directly, with no calls back into Lua. 'stablesort' with a
+** comparator calls it on the values; without one, the values are
+** their own keys.)
+** =======================================================
+*/
+
+/* runs of this length are sorted by insertion before merging */
+#if !defined(MERGERUN)
+#define MERGERUN	32
+#endif
+
+
+/* kinds of keys (bits, while collecting them) */
+#define KEYINT		1	/* all integers */
+#define KEYFLT		2	/* all floats */
+#define KEYSTR		4	/* all strings */
+#define KEYANY		8	/* anything else: compare with 'lua_compare' */
+#define KEYCALL		16	/* compare values with the given function */
+
+
+typedef struct SortKey {
+  union {
+    lua_Integer i;
+    lua_Number f;
+    const char *s;
+  } k;
+  size_t len;  /* length of a string key */
+  lua_Integer pos;  /* original position of the element */
+} SortKey;
+
+
+/*
+** Order of strings as given by the '<' operator.
+*/
+static int strlt (const char *l, size_t ll, const char *r, size_t lr) {
+#if defined(LUA_NOSTRCOLL)
+  int temp = memcmp(l, r, (ll < lr) ? ll : lr);
+  return (temp != 0) ? (temp < 0) : (ll < lr);
+#else
+  for (;;) {  /* for each segment between '\0's */
+    int temp = strcoll(l, r);
+    if (temp != 0)  /* not equal? */
+      return (temp < 0);
+    else {
+      size_t len = strlen(l);  /* index of first '\0' in both strings */
+      if (len == lr)  /* 'r' is finished? */
+        return 0;
+      else if (len == ll)  /* 'l' is finished ('r' is not)? */
+        return 1;
+      len++;
+      l += len; ll -= len; r += len; lr -= len;
+    }
+  }
+#endif
+}
+
+
+/*
+** Stack: 1 = list, 2 = comparator or key, 3 = values, 4 = keys
+** (values for KEYCALL), 5 = buffer of entries
+*/
+static int keylt (lua_State *L, int kind, const SortKey *a,
+                                          const SortKey *b) {
+  switch (kind) {
+    case KEYINT: return (a->k.i < b->k.i);
+    case KEYFLT: return (a->k.f < b->k.f);
+    case KEYSTR: return strlt(a->k.s, a->len, b->k.s, b->len);
+    case KEYCALL: {
+      int res;
+      lua_pushvalue(L, 2);
+      lua_rawgeti(L, 4, a->pos);
+      lua_rawgeti(L, 4, b->pos);
+      lua_call(L, 2, 1);
+      res = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+      return res;
+    }
+    default: {
+      int res;
+      lua_rawgeti(L, 4, a->pos);
+      lua_rawgeti(L, 4, b->pos);
+      res = lua_compare(L, -2, -1, LUA_OPLT);
+      lua_pop(L, 2);
+      return res;
+    }
+  }
+}
+
+
+/*
+** Merge sort of a[0 .. n-1], using 'tmp' (with room for 'n' entries)
+** to hold the left run of each merge.
+*/
+static void mergekeys (lua_State *L, int kind, SortKey *a, SortKey *tmp,
+                                               size_t n) {
+  size_t lo, w;
+  for (lo = 0; lo < n; lo += MERGERUN) {  /* insertion sort of runs */
+    size_t up = (n - lo < MERGERUN) ? n : lo + MERGERUN;
+    size_t i;
+    for (i = lo + 1; i < up; i++) {
+      if (keylt(L, kind, &a[i], &a[i - 1])) {
+        SortKey e = a[i];
+        size_t j = i;
+        do {
+          a[j] = a[j - 1];
+          j--;
+        } while (j > lo && keylt(L, kind, &e, &a[j - 1]));
+        a[j] = e;
+      }
+    }
+  }
+  for (w = MERGERUN; w < n; w *= 2) {  /* merge runs of length 'w' */
+    for (lo = 0; lo + w < n; lo += 2 * w) {
+      size_t mid = lo + w;
+      size_t up = (n - mid < w) ? n : mid + w;
+      if (keylt(L, kind, &a[mid], &a[mid - 1])) {  /* not in order yet? */
+        size_t i = 0, j = mid, k = lo;
+        memcpy(tmp, a + lo, w * sizeof(SortKey));
+        while (i < w && j < up) {
+          if (keylt(L, kind, &a[j], &tmp[i]))  /* take from the right */
+            a[k++] = a[j++];  /* only if strictly smaller (stability) */
+          else
+            a[k++] = tmp[i++];
+        }
+        while (i < w)
+          a[k++] = tmp[i++];
+      }
+    }
+  }
+}
+
+
+/*
+** Collect values (and their keys, unless 'kind' is KEYCALL), sort them,
+** and store them back in the list.
+*/
+static void keysort (lua_State *L, IdxT n, int kind) {
+  SortKey *a;
+  IdxT i;
+  if ((size_t)n + 1 > ((size_t)~(size_t)0) / (2 * sizeof(SortKey)))
+    luaL_error(L, "array too big");  /* (+1 to avoid warnings) */
+  lua_settop(L, 2);
+  lua_createtable(L, (int)n, 0);  /* values */
+  if (kind == KEYCALL)
+    lua_pushvalue(L, 3);  /* comparator works on the values */
+  else
+    lua_createtable(L, (int)n, 0);  /* keys */
+  a = (SortKey *)lua_newuserdata(L, 2 * (size_t)n * sizeof(SortKey));
+  for (i = 0; i < n; i++) {
+    SortKey *e = &a[i];
+    e->pos = (lua_Integer)i + 1;
+    lua_geti(L, 1, e->pos);
+    if (kind != KEYCALL) {
+      if (lua_isnil(L, 2))  /* value is its own key? */
+        lua_pushvalue(L, -1);
+      else if (lua_type(L, 2) == LUA_TFUNCTION) {
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, -2);
+        lua_call(L, 1, 1);  /* key = f(value) */
+      }
+      else {
+        lua_pushvalue(L, 2);
+        lua_gettable(L, -2);  /* key = value[field] */
+      }
+      switch (lua_type(L, -1)) {
+        case LUA_TNUMBER: {
+          if (lua_isinteger(L, -1)) {
+            e->k.i = lua_tointeger(L, -1);
+            kind |= KEYINT;
+          }
+          else {
+            e->k.f = lua_tonumber(L, -1);
+            kind |= KEYFLT;
+          }
+          break;
+        }
+        case LUA_TSTRING: {  /* string is kept alive in the keys table */
+          e->k.s = lua_tolstring(L, -1, &e->len);
+          kind |= KEYSTR;
+          break;
+        }
+        default: kind |= KEYANY; break;
+      }
+      lua_rawseti(L, 4, e->pos);
+    }
+    lua_rawseti(L, 3, e->pos);
+  }
+  if (kind != KEYINT && kind != KEYFLT && kind != KEYSTR &&
+      kind != KEYCALL)
+    kind = KEYANY;  /* mixed kinds */
+  mergekeys(L, kind, a, a + n, n);
+  for (i = 0; i < n; i++) {  /* move values to their new positions */
+    lua_rawgeti(L, 3, a[i].pos);
+    lua_seti(L, 1, (lua_Integer)i + 1);
+  }
+}
+
+
+static int stablesort (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_RW);
+  if (n > 1) {  /* non-trivial interval? */
+    luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+    if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
+      luaL_checktype(L, 2, LUA_TFUNCTION);  /* must be a function */
+    lua_settop(L, 2);
+    keysort(L, (IdxT)n, lua_isnil(L, 2) ? 0 : KEYCALL);
+  }
+  return 0;
+}
+
+
+static int sortby (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_RW);
+  luaL_argcheck(L, !lua_isnoneornil(L, 2), 2,
+                   "key function or field expected");
+  if (n > 1) {  /* non-trivial interval? */
+    luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+    keysort(L, (IdxT)n, 0);
   }
   return 0;
 }
@@ -433,7 +800,12 @@ static const luaL_Reg tab_funcs[] = {
   {"unpack", unpack},
   {"remove", tremove},
   {"move", tmove},
+  {"clone", tclone},
+  {"fill", tfill},
+  {"slice", tslice},
   {"sort", sort},
+  {"stablesort", stablesort},
+  {"sortby", sortby},
   {NULL, NULL}
 };
 
@@ -237,6 +237,17 @@ static void checktable (global_State *g, Table *h) {
       checkvalref(g, hgc, gval(n));
     }
   }
+  if (h->old != NULL) {  /* incremental rehash in progress? */
+    lua_assert(0 <= h->old->cursor && h->old->cursor <= h->old->size);
+    for (n = h->old->node; n < h->old->node + h->old->size; n++) {
+      if (!ttisnil(gval(n))) {
+        lua_assert(n - h->old->node >= h->old->cursor);  /* not moved yet */
+        lua_assert(!ttisnil(gkey(n)));
+        checkvalref(g, hgc, gkey(n));
+        checkvalref(g, hgc, gval(n));
+      }
+    }
+  }
 }
 
 
@@ -356,6 +367,11 @@ static void checkobject (global_State *g, GCObject *o, int maybedead) {
       case LUA_TSHRSTR:
       case LUA_TLNGSTR: {
         lua_assert(!isgray(o));  /* strings are never gray */
+        if (o->tt == LUA_TLNGSTR && isstrview(gco2ts(o))) {
+          TString *p = getstrref(gco2ts(o))->parent;
+          lua_assert(!isstrview(p));  /* views do not form chains */
+          checkobjref(g, o, p);
+        }
         break;
       }
       default: lua_assert(0);
@@ -409,6 +425,48 @@ static void checkgray (global_State *g, GCObject *o) {
 }
 
 
+#if defined(LUAI_GCPAGES)
+
+/*
+** check objects in heap pages; objects also kept in other lists are
+** checked with those lists
+*/
+static void checkpages (global_State *g, int maybedead) {
+  GCPage *p;
+  for (p = g->pages; p != NULL; p = p->next) {
+    int nused = 0;
+    int b;
+    for (b = 0; b < cast_int(GCPAGEWORDS) * GCWORDBITS; b++) {
+      GCObject *o = gcbitslot(p, b);
+      if (!gctstpagebit(p->alloc, b)) {
+        lua_assert(!gctstpagebit(p->mark, b) && !gctstpagebit(p->keep, b));
+        continue;
+      }
+      nused++;
+      lua_assert(ispaged(o) && gcpageof(o) == p);
+      lua_assert(b >= cast_int(GCPAGEHEADER >> GCGRAINBITS));
+      if (gctstpagebit(p->keep, b))
+        lua_assert(tofinalize(o) || (o->tt == LUA_TSHRSTR && isgray(o)));
+      else {
+        if (isgray(o)) {
+          lua_assert(!keepinvariant(g) || testbit(o->marked, TESTGRAYBIT));
+          resetbit(o->marked, TESTGRAYBIT);
+        }
+        lua_assert(!testbit(o->marked, TESTGRAYBIT));
+        checkobject(g, o, maybedead && gcpendingpage(g, p));
+        lua_assert(!tofinalize(o));
+        /* marked objects must be marked in their pages, too */
+        lua_assert(!keepinvariant(g) || iswhite(o) ||
+                   gctstpagebit(p->mark, b));
+      }
+    }
+    lua_assert(nused == p->nused);
+  }
+}
+
+#endif
+
+
 int lua_checkmemory (lua_State *L) {
   global_State *g = G(L);
   GCObject *o;
@@ -433,6 +491,10 @@ int lua_checkmemory (lua_State *L) {
     checkobject(g, o, maybedead);
     lua_assert(!tofinalize(o));
   }
+#if defined(LUAI_GCPAGES)
+  lua_assert(g->sweeppage == NULL || issweepphase(g));
+  checkpages(g, maybedead);
+#endif
   /* check 'finobj' list */
   checkgray(g, g->finobj);
   for (o = g->finobj; o != NULL; o = o->next) {
@@ -721,7 +783,7 @@ static int string_query (lua_State *L) {
     lua_pushinteger(L ,tb->nuse);
     return 2;
   }
-  else if (s < tb->size) {
+  else if (s < strtallocsize(tb)) {
     TString *ts;
     int n = 0;
     for (ts = tb->hash[s]; ts != NULL; ts = ts->u.hnext) {
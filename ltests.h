@@ -111,6 +111,7 @@ LUA_API void *debug_realloc (void *ud, void *block,
 #define LUAL_BUFFERSIZE		23
 #define MINSTRTABSIZE		2
 #define MAXINDEXRK		1
+#define TABINCRBITS		3
 
 
 /* make stack-overflow tests run faster */
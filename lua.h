@@ -225,6 +225,13 @@ LUA_API void        (lua_pushnil) (lua_State *L);
 LUA_API void        (lua_pushnumber) (lua_State *L, lua_Number n);
 LUA_API void        (lua_pushinteger) (lua_State *L, lua_Integer n);
 LUA_API const char *(lua_pushlstring) (lua_State *L, const char *s, size_t len);
+LUA_API void        (lua_pushsubstring) (lua_State *L, int idx, size_t pos,
+                                                                size_t len);
+LUA_API const char *(lua_pushexternalstring) (lua_State *L, const char *s,
+                                    size_t len, lua_Alloc falloc, void *ud);
+LUA_API char       *(lua_prepstring) (lua_State *L, size_t len);
+LUA_API char       *(lua_resizestring) (lua_State *L, int idx, size_t len);
+LUA_API const char *(lua_finishstring) (lua_State *L, int idx, size_t len);
 LUA_API const char *(lua_pushstring) (lua_State *L, const char *s);
 LUA_API const char *(lua_pushvfstring) (lua_State *L, const char *fmt,
                                                       va_list argp);
@@ -242,11 +249,13 @@ LUA_API int (lua_getglobal) (lua_State *L, const char *name);
 LUA_API int (lua_gettable) (lua_State *L, int idx);
 LUA_API int (lua_getfield) (lua_State *L, int idx, const char *k);
 LUA_API int (lua_geti) (lua_State *L, int idx, lua_Integer n);
+LUA_API int (lua_getarray) (lua_State *L, int idx, lua_Integer i, int n);
 LUA_API int (lua_rawget) (lua_State *L, int idx);
 LUA_API int (lua_rawgeti) (lua_State *L, int idx, lua_Integer n);
 LUA_API int (lua_rawgetp) (lua_State *L, int idx, const void *p);
 
 LUA_API void  (lua_createtable) (lua_State *L, int narr, int nrec);
+LUA_API void  (lua_clonetable) (lua_State *L, int idx);
 LUA_API void *(lua_newuserdata) (lua_State *L, size_t sz);
 LUA_API int   (lua_getmetatable) (lua_State *L, int objindex);
 LUA_API int  (lua_getuservalue) (lua_State *L, int idx);
@@ -308,6 +317,10 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
 #define LUA_GCISRUNNING		9
+#define LUA_GCSETMAXPAUSE	10
+#define LUA_GCSETGROWTH		11
+#define LUA_GCSTEPHIST		12
+#define LUA_GCATOMICSTATS	13
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
@@ -322,6 +335,9 @@ LUA_API int   (lua_next) (lua_State *L, int idx);
 
 LUA_API void  (lua_concat) (lua_State *L, int n);
 LUA_API void  (lua_len)    (lua_State *L, int idx);
+LUA_API int   (lua_sortarray) (lua_State *L, int idx, lua_Integer n);
+LUA_API int   (lua_movearray) (lua_State *L, int idx1, lua_Integer f,
+                               lua_Integer e, lua_Integer t, int idx2);
 
 LUA_API size_t   (lua_stringtonumber) (lua_State *L, const char *s);
 
@@ -422,6 +422,7 @@
 ** by prefixing it with one of FLT/DBL/LDBL.
 @@ LUA_NUMBER_FRMLEN is the length modifier for writing floats.
 @@ LUA_NUMBER_FMT is the format for writing floats.
+@@ LUAI_NUMPREC is the precision used by LUA_NUMBER_FMT.
 @@ lua_number2str converts a float to a string.
 @@ l_mathop allows the addition of an 'l' or 'f' to all math operations.
 @@ l_floor takes the floor of a float.
@@ -462,6 +463,7 @@
 
 #define LUA_NUMBER_FRMLEN	""
 #define LUA_NUMBER_FMT		"%.7g"
+#define LUAI_NUMPREC		7
 
 #define l_mathop(op)		op##f
 
@@ -478,6 +480,7 @@
 
 #define LUA_NUMBER_FRMLEN	"L"
 #define LUA_NUMBER_FMT		"%.19Lg"
+#define LUAI_NUMPREC		19
 
 #define l_mathop(op)		op##l
 
@@ -493,6 +496,7 @@
 
 #define LUA_NUMBER_FRMLEN	""
 #define LUA_NUMBER_FMT		"%.14g"
+#define LUAI_NUMPREC		14
 
 #define l_mathop(op)		op
 
@@ -692,6 +696,22 @@
 /* #define LUA_NOCVTS2N */
 
 
+/*
+@@ LUA_NOSTRCOLL makes order comparisons between strings ignore the
+** current locale: strings are compared byte by byte (as unsigned
+** chars), which is much faster than 'strcoll'.
+*/
+/* #define LUA_NOSTRCOLL */
+
+
+/*
+@@ LUA_FLOATROUNDTRIP makes the conversion of floats to strings use
+** as many digits as needed (from LUAI_NUMPREC on) for the result to
+** read back as the same float, instead of always using LUA_NUMBER_FMT.
+*/
+/* #define LUA_FLOATROUNDTRIP */
+
+
 /*
 @@ LUA_USE_APICHECK turns on several consistency checks on the C API.
 ** Define it as a help when debugging C code.
@@ -25,6 +25,11 @@
 #define iscont(p)	((*(p) & 0xC0) == 0x80)
 
 
+/* a word with all bytes equal to 0x80 */
+#define WHIGHS		(((size_t)~(size_t)0 / UCHAR_MAX) * 0x80)
+
+
+
 /* from strlib */
 /* translate a relative string position: negative means back from end */
 static lua_Integer u_posrelat (lua_Integer pos, size_t len) {
@@ -63,36 +68,127 @@ static const char *utf8_decode (const char *o, int *val) {
 }
 
 
+/* check whether the word at 'p' has only ASCII chars */
+static int isasciiword (const char *p) {
+  size_t w;
+  memcpy(&w, p, sizeof(size_t));
+  return (w & WHIGHS) == 0;
+}
+
+
 /*
-** utf8len(s [, i [, j]]) --> number of characters that start in the
-** range [i,j], or nil + current position if 's' is not well formed in
-** that interval
+** Skip the non-ASCII UTF-8 sequence at 'o', returning NULL if it is
+** invalid. (Accepts the same sequences as 'utf8_decode', without
+** computing their values.)
 */
-static int utflen (lua_State *L) {
-  int n = 0;
+static const char *utf8_skip (const char *o) {
+  const unsigned char *s = (const unsigned char *)o;
+  unsigned int c = s[0];
+  if (c < 0xC2)  /* continuation byte or overlong 2-byte sequence? */
+    return NULL;
+  else if (c < 0xE0)  /* 2 bytes */
+    return iscont(s + 1) ? o + 2 : NULL;
+  else if (c < 0xF0) {  /* 3 bytes */
+    if (!iscont(s + 1) || !iscont(s + 2) || (c == 0xE0 && s[1] < 0xA0))
+      return NULL;
+    return o + 3;
+  }
+  else if (c < 0xF5) {  /* 4 bytes */
+    if (!iscont(s + 1) || !iscont(s + 2) || !iscont(s + 3) ||
+        (c == 0xF0 && s[1] < 0x90) || (c == 0xF4 && s[1] > 0x8F))
+      return NULL;
+    return o + 4;
+  }
+  else return NULL;  /* too large */
+}
+
+
+/*
+** Count the characters that start in [s, e), adding them to '*n'.
+** Words with only ASCII chars are counted at once. Returns NULL if all
+** those characters are valid; otherwise, returns the first invalid one.
+*/
+static const char *utf8_count (const char *s, const char *e,
+                               lua_Integer *n) {
+  lua_Integer count = 0;
+  while (s < e) {
+    if ((unsigned char)*s < 0x80) {  /* ASCII? */
+      if ((size_t)(e - s) >= sizeof(size_t) && isasciiword(s)) {
+        s += sizeof(size_t);  /* skip the whole word */
+        count += sizeof(size_t);
+      }
+      else {
+        s++;
+        count++;
+      }
+    }
+    else {
+      const char *s1 = utf8_skip(s);
+      if (s1 == NULL)  /* invalid sequence? */
+        break;
+      s = s1;
+      count++;
+    }
+  }
+  *n += count;
+  return (s < e) ? s : NULL;
+}
+
+
+/* get the range [i,j] of 'utf8.len' and 'utf8.valid' */
+static const char *getrange (lua_State *L, lua_Integer *posi,
+                                           lua_Integer *posj) {
   size_t len;
   const char *s = luaL_checklstring(L, 1, &len);
-  lua_Integer posi = u_posrelat(luaL_optinteger(L, 2, 1), len);
-  lua_Integer posj = u_posrelat(luaL_optinteger(L, 3, -1), len);
-  luaL_argcheck(L, 1 <= posi && --posi <= (lua_Integer)len, 2,
+  *posi = u_posrelat(luaL_optinteger(L, 2, 1), len);
+  *posj = u_posrelat(luaL_optinteger(L, 3, -1), len);
+  luaL_argcheck(L, 1 <= *posi && --*posi <= (lua_Integer)len, 2,
                    "initial position out of string");
-  luaL_argcheck(L, --posj < (lua_Integer)len, 3,
+  luaL_argcheck(L, --*posj < (lua_Integer)len, 3,
                    "final position out of string");
-  while (posi <= posj) {
-    const char *s1 = utf8_decode(s + posi, NULL);
-    if (s1 == NULL) {  /* conversion error? */
-      lua_pushnil(L);  /* return nil ... */
-      lua_pushinteger(L, posi + 1);  /* ... and current position */
-      return 2;
-    }
-    posi = s1 - s;
-    n++;
+  return s;
+}
+
+
+/*
+** utf8len(s [, i [, j]]) --> number of characters that start in the
+** range [i,j], or nil + current position if 's' is not well formed in
+** that interval
+*/
+static int utflen (lua_State *L) {
+  lua_Integer n = 0;
+  lua_Integer posi, posj;
+  const char *s = getrange(L, &posi, &posj);
+  const char *err = utf8_count(s + posi, s + posj + 1, &n);
+  if (err != NULL) {  /* conversion error? */
+    lua_pushnil(L);  /* return nil ... */
+    lua_pushinteger(L, (err - s) + 1);  /* ... and current position */
+    return 2;
   }
   lua_pushinteger(L, n);
   return 1;
 }
 
 
+/*
+** valid(s [, i [, j]]) --> true if all characters that start in the
+** range [i,j] are well formed, or false + position of the first one
+** that is not
+*/
+static int utfvalid (lua_State *L) {
+  lua_Integer n = 0;
+  lua_Integer posi, posj;
+  const char *s = getrange(L, &posi, &posj);
+  const char *err = utf8_count(s + posi, s + posj + 1, &n);
+  lua_pushboolean(L, err == NULL);
+  if (err != NULL) {
+    lua_pushinteger(L, (err - s) + 1);
+    return 2;
+  }
+  return 1;
+}
+
+
 /*
 ** codepoint(s, [i, [j]])  -> returns codepoints for all characters
 ** that start in the range [i,j]
@@ -174,19 +270,40 @@ static int byteoffset (lua_State *L) {
       luaL_error(L, "initial position is a continuation byte");
     if (n < 0) {
        while (n < 0 && posi > 0) {  /* move back */
-         do {  /* find beginning of previous character */
-           posi--;
-         } while (posi > 0 && iscont(s + posi));
-         n++;
+         int k;
+         if (-n >= (lua_Integer)sizeof(size_t) &&
+             posi >= (lua_Integer)sizeof(size_t) &&
+             isasciiword(s + posi - sizeof(size_t))) {  /* ASCII? */
+           posi -= sizeof(size_t);  /* skip a word of characters */
+           n += sizeof(size_t);
+           continue;
+         }
+         for (k = sizeof(size_t); k > 0 && n < 0 && posi > 0; k--) {
+           do {  /* find beginning of previous character */
+             posi--;
+           } while (posi > 0 && iscont(s + posi));
+           n++;
+         }
        }
      }
      else {
        n--;  /* do not move for 1st character */
        while (n > 0 && posi < (lua_Integer)len) {
-         do {  /* find beginning of next character */
-           posi++;
-         } while (iscont(s + posi));  /* (cannot pass final '\0') */
-         n--;
+         int k;
+         if (n >= (lua_Integer)sizeof(size_t) &&
+             (lua_Integer)(len - posi) >= (lua_Integer)sizeof(size_t) &&
+             isasciiword(s + posi + 1)) {  /* next chars are ASCII? */
+           posi += sizeof(size_t);  /* skip a word of characters */
+           n -= sizeof(size_t);
+           continue;
+         }
+         for (k = sizeof(size_t); k > 0 && n > 0 && posi < (lua_Integer)len;
+              k--) {
+           do {  /* find beginning of next character */
+             posi++;
+           } while (iscont(s + posi));  /* (cannot pass final '\0') */
+           n--;
+         }
        }
      }
   }
@@ -240,6 +357,7 @@ static const luaL_Reg funcs[] = {
   {"codepoint", codepoint},
   {"char", utfchar},
   {"len", utflen},
+  {"valid", utfvalid},
   {"codes", iter_codes},
   /* placeholders */
   {"charpattern", NULL},
@@ -18,6 +18,7 @@
 
 #include "lua.h"
 
+#include "lctype.h"
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
@@ -65,18 +66,50 @@
 
 
 
+/* maximum length of a numeral converted from a view without copying it */
+#if !defined(MAXVIEWNUM)
+#define MAXVIEWNUM	200
+#endif
+
+
+/*
+** Try to convert string 'obj' to a number in 'v'. A view is not followed
+** by a '\0' (as 'luaO_str2num' needs), so a short numeral (without the
+** surrounding spaces) is copied to a buffer first; a view with a longer
+** one is made to own its contents. (This can raise a memory error.)
+*/
+static int l_strton (lua_State *L, const TValue *obj, TValue *v) {
+  TString *ts = tsvalue(obj);
+  if (isstrview(ts)) {
+    char buff[MAXVIEWNUM + 1];
+    const char *s = getstr(ts);
+    size_t l = ts->u.lnglen;
+    while (l > 0 && lisspace(cast_uchar(*s))) { s++; l--; }
+    while (l > 0 && lisspace(cast_uchar(s[l - 1]))) l--;
+    if (l > MAXVIEWNUM)  /* too long for the buffer? */
+      luaS_detach(L, ts);  /* convert it in place (below) */
+    else {
+      memcpy(buff, s, l * sizeof(char));
+      buff[l] = '\0';
+      return (luaO_str2num(buff, v) == l + 1);
+    }
+  }
+  return (luaO_str2num(getstr(ts), v) == tsslen(ts) + 1);
+}
+
+
 /*
 ** Try to convert a value to a float. The float case is already handled
 ** by the macro 'tonumber'.
 */
-int luaV_tonumber_ (const TValue *obj, lua_Number *n) {
+int luaV_tonumber_ (lua_State *L, const TValue *obj, lua_Number *n) {
   TValue v;
   if (ttisinteger(obj)) {
     *n = cast_num(ivalue(obj));
     return 1;
   }
   else if (cvt2num(obj) &&  /* string convertible to number? */
-            luaO_str2num(svalue(obj), &v) == vslen(obj) + 1) {
+            l_strton(L, obj, &v)) {
     *n = nvalue(&v);  /* convert result of 'luaO_str2num' to a float */
     return 1;
   }
@@ -86,14 +119,13 @@ int luaV_tonumber_ (const TValue *obj, lua_Number *n) {
 
 
 /*
-** try to convert a value to an integer, rounding according to 'mode':
+** try to convert a value (other than a string) to an integer, rounding
+** according to 'mode':
 ** mode == 0: accepts only integral values
 ** mode == 1: takes the floor of the number
 ** mode == 2: takes the ceil of the number
 */
-int luaV_tointeger (const TValue *obj, lua_Integer *p, int mode) {
-  TValue v;
- again:
+int luaV_tointegerns (const TValue *obj, lua_Integer *p, int mode) {
   if (ttisfloat(obj)) {
     lua_Number n = fltvalue(obj);
     lua_Number f = l_floor(n);
@@ -108,12 +140,20 @@ int luaV_tointeger (const TValue *obj, lua_Integer *p, int mode) {
     *p = ivalue(obj);
     return 1;
   }
-  else if (cvt2num(obj) &&
-            luaO_str2num(svalue(obj), &v) == vslen(obj) + 1) {
-    obj = &v;
-    goto again;  /* convert result from 'luaO_str2num' to an integer */
-  }
-  return 0;  /* conversion failed */
+  else
+    return 0;  /* conversion failed */
+}
+
+
+/*
+** try to convert a value to an integer (see 'luaV_tointegerns')
+*/
+int luaV_tointeger (lua_State *L, const TValue *obj, lua_Integer *p,
+                    int mode) {
+  TValue v;
+  if (cvt2num(obj) && l_strton(L, obj, &v))  /* convertible string? */
+    obj = &v;  /* convert result from 'luaO_str2num' to an integer */
+  return luaV_tointegerns(obj, p, mode);
 }
 
 
@@ -132,10 +172,10 @@ int luaV_tointeger (const TValue *obj, lua_Integer *p, int mode) {
 ** the extreme case when the initial value is LUA_MININTEGER, in which
 ** case the LUA_MININTEGER limit would still run the loop once.
 */
-static int forlimit (const TValue *obj, lua_Integer *p, lua_Integer step,
-                     int *stopnow) {
+static int forlimit (lua_State *L, const TValue *obj, lua_Integer *p,
+                     lua_Integer step, int *stopnow) {
   *stopnow = 0;  /* usually, let loops run */
-  if (!luaV_tointeger(obj, p, (step < 0 ? 2 : 1))) {  /* not fit in integer? */
+  if (!luaV_tointeger(L, obj, p, (step < 0 ? 2 : 1))) {  /* not an integer? */
     lua_Number n;  /* try to convert to float */
     if (!tonumber(obj, &n)) /* cannot convert to float? */
       return 0;  /* not a number */
@@ -241,14 +281,32 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
 /*
 ** Compare two strings 'ls' x 'rs', returning an integer smaller-equal-
 ** -larger than zero if 'ls' is smaller-equal-larger than 'rs'.
+*/
+#if defined(LUA_NOSTRCOLL)
+
+/* byte-wise comparison: common prefix, then the lengths */
+static int l_strcmp (lua_State *L, TString *ls, TString *rs) {
+  size_t ll = tsslen(ls);
+  size_t lr = tsslen(rs);
+  int temp = memcmp(getstr(ls), getstr(rs), (ll < lr) ? ll : lr);
+  UNUSED(L);
+  if (temp != 0)  /* not equal? */
+    return temp;  /* done */
+  else  /* one string is a prefix of the other */
+    return (ll < lr) ? -1 : (ll > lr);
+}
+
+#else
+
+/*
 ** The code is a little tricky because it allows '\0' in the strings
 ** and it uses 'strcoll' (to respect locales) for each segments
 ** of the strings.
 */
-static int l_strcmp (const TString *ls, const TString *rs) {
-  const char *l = getstr(ls);
+static int l_strcmp (lua_State *L, TString *ls, TString *rs) {
+  const char *l = luaS_tocstr(L, ls);
   size_t ll = tsslen(ls);
-  const char *r = getstr(rs);
+  const char *r = luaS_tocstr(L, rs);
   size_t lr = tsslen(rs);
   for (;;) {  /* for each segment */
     int temp = strcoll(l, r);
@@ -267,6 +325,8 @@ static int l_strcmp (const TString *ls, const TString *rs) {
   }
 }
 
+#endif
+
 
 /*
 ** Check whether integer 'i' is less than float 'f'. If 'i' has an
@@ -366,7 +426,7 @@ int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
   if (ttisnumber(l) && ttisnumber(r))  /* both operands are numbers? */
     return LTnum(l, r);
   else if (ttisstring(l) && ttisstring(r))  /* both are strings? */
-    return l_strcmp(tsvalue(l), tsvalue(r)) < 0;
+    return l_strcmp(L, tsvalue(l), tsvalue(r)) < 0;
   else if ((res = luaT_callorderTM(L, l, r, TM_LT)) < 0)  /* no metamethod? */
     luaG_ordererror(L, l, r);  /* error */
   return res;
@@ -386,7 +446,7 @@ int luaV_lessequal (lua_State *L, const TValue *l, const TValue *r) {
   if (ttisnumber(l) && ttisnumber(r))  /* both operands are numbers? */
     return LEnum(l, r);
   else if (ttisstring(l) && ttisstring(r))  /* both are strings? */
-    return l_strcmp(tsvalue(l), tsvalue(r)) <= 0;
+    return l_strcmp(L, tsvalue(l), tsvalue(r)) <= 0;
   else if ((res = luaT_callorderTM(L, l, r, TM_LE)) >= 0)  /* try 'le' */
     return res;
   else {  /* try 'lt': */
@@ -411,7 +471,7 @@ int luaV_equalobj (lua_State *L, const TValue *t1, const TValue *t2) {
       return 0;  /* only numbers can be equal with different variants */
     else {  /* two numbers with different variants */
       lua_Integer i1, i2;  /* compare them as integers */
-      return (tointeger(t1, &i1) && tointeger(t2, &i2) && i1 == i2);
+      return (tointegerns(t1, &i1) && tointegerns(t2, &i2) && i1 == i2);
     }
   }
   /* values have same type and same variant */
@@ -499,9 +559,16 @@ void luaV_concat (lua_State *L, int total) {
         copy2buff(top, n, buff);  /* copy strings to buffer */
         ts = luaS_newlstr(L, buff, tl);
       }
+      else if (ttislngstring(top - n) &&
+               luaS_canextend(tsvalue(top - n))) {  /* accumulating? */
+        char *p;  /* build result in an append buffer */
+        ts = luaS_extend(L, tsvalue(top - n), tl, &p);
+        copy2buff(top, n - 1, p);  /* copy the other strings */
+      }
       else {  /* long string; copy strings directly to final result */
         ts = luaS_createlngstrobj(L, tl);
         copy2buff(top, n, getstr(ts));
+        ts->shrlen = LSTRCAT;  /* may be extended by a later concatenation */
       }
       setsvalue2s(L, top - n, ts);  /* create result */
     }
@@ -1218,7 +1285,7 @@ void luaV_execute (lua_State *L) {
         lua_Integer ilimit;
         int stopnow;
         if (ttisinteger(init) && ttisinteger(pstep) &&
-            forlimit(plimit, &ilimit, ivalue(pstep), &stopnow)) {
+            forlimit(L, plimit, &ilimit, ivalue(pstep), &stopnow)) {
           /* all values are integer */
           lua_Integer initv = (stopnow ? 0 : ivalue(init));
           setivalue(plimit, ilimit);
@@ -37,11 +37,19 @@
 #endif
 
 
+/* convert an object to a number (including string coercion) */
 #define tonumber(o,n) \
-	(ttisfloat(o) ? (*(n) = fltvalue(o), 1) : luaV_tonumber_(o,n))
+	(ttisfloat(o) ? (*(n) = fltvalue(o), 1) : luaV_tonumber_(L,o,n))
 
+/* convert an object to an integer (including string coercion) */
 #define tointeger(o,i) \
-    (ttisinteger(o) ? (*(i) = ivalue(o), 1) : luaV_tointeger(o,i,LUA_FLOORN2I))
+  (ttisinteger(o) ? (*(i) = ivalue(o), 1) \
+                  : luaV_tointeger(L,o,i,LUA_FLOORN2I))
+
+/* convert an object to an integer (without string coercion) */
+#define tointegerns(o,i) \
+  (ttisinteger(o) ? (*(i) = ivalue(o), 1) \
+                  : luaV_tointegerns(o,i,LUA_FLOORN2I))
 
 #define intop(op,v1,v2) l_castU2S(l_castS2U(v1) op l_castS2U(v2))
 
@@ -96,8 +104,10 @@
 LUAI_FUNC int luaV_equalobj (lua_State *L, const TValue *t1, const TValue *t2);
 LUAI_FUNC int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r);
 LUAI_FUNC int luaV_lessequal (lua_State *L, const TValue *l, const TValue *r);
-LUAI_FUNC int luaV_tonumber_ (const TValue *obj, lua_Number *n);
-LUAI_FUNC int luaV_tointeger (const TValue *obj, lua_Integer *p, int mode);
+LUAI_FUNC int luaV_tonumber_ (lua_State *L, const TValue *obj, lua_Number *n);
+LUAI_FUNC int luaV_tointeger (lua_State *L, const TValue *obj, lua_Integer *p,
+                              int mode);
+LUAI_FUNC int luaV_tointegerns (const TValue *obj, lua_Integer *p, int mode);
 LUAI_FUNC void luaV_finishget (lua_State *L, const TValue *t, TValue *key,
                                StkId val, const TValue *slot);
 LUAI_FUNC void luaV_finishset (lua_State *L, const TValue *t, TValue *key,